@@ -0,0 +1,31 @@
+# Generates a C source holding the complete HTTP response of an embedded file: status line, headers and body.
+# The http server sends it as is, without formatting any header at runtime.
+#
+# usage: cmake -DINPUT=<file> -DOUTPUT=<file.c> -DNAME=<symbol> -DCONTENT_TYPE=<type> [-DCACHE_CONTROL=<value>] -P http_response.cmake
+#
+# The file is read as hex: reading it as text would drop carriage returns.
+
+file(READ "${INPUT}" body HEX)
+string(LENGTH "${body}" length)
+math(EXPR length "${length} / 2")
+
+set(headers "HTTP/1.1 200 OK\r\nContent-Type: ${CONTENT_TYPE}\r\n")
+if(CACHE_CONTROL)
+    set(headers "${headers}Cache-Control: ${CACHE_CONTROL}\r\n")
+endif()
+set(headers "${headers}Content-Length: ${length}\r\n\r\n")
+
+file(WRITE "${OUTPUT}.headers" "${headers}")
+file(READ "${OUTPUT}.headers" headers HEX)
+file(REMOVE "${OUTPUT}.headers")
+
+# 16 bytes (32 hex digits) per line
+set(line "")
+foreach(i RANGE 1 32)
+    set(line "${line}[0-9a-f]")
+endforeach()
+string(REGEX REPLACE "(${line})" "\\1\n" bytes "${headers}${body}")
+string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," bytes "${bytes}")
+
+get_filename_component(input_name "${INPUT}" NAME)
+file(WRITE "${OUTPUT}" "/* complete HTTP response of ${input_name}, generated by http_response.cmake: do not edit */\n#include <stddef.h>\n\nconst char ${NAME}[] = {\n${bytes}\n};\nconst size_t ${NAME}_len = sizeof(${NAME});\n")
@@ -0,0 +1,277 @@
+#!/usr/bin/env python
+#
+# Prepares the web app files served by the http server, at build time.
+#
+#  - the base64 SVG icons of style.css become UTF-8 data URIs, without the XML and DOCTYPE preamble
+#  - style.css and code.js are minified
+#  - style.css is inlined in index.html so the page is painted after a single request
+#  - a size report is printed, and written next to the output files
+#
+# usage: webapp_bundle.py <source dir> <output dir> [--no-minify]
+#
+# Only the standard library is used: the build does not depend on anything that is not shipped with ESP-IDF.
+
+from __future__ import print_function
+
+import base64
+import io
+import os
+import re
+import sys
+import zlib
+
+
+def read(path):
+    with io.open(path, 'r', encoding='utf-8', newline='') as f:
+        return f.read()
+
+
+def write(path, text):
+    with io.open(path, 'w', encoding='utf-8', newline='') as f:
+        f.write(text)
+
+
+# ---- SVG ----------------------------------------------------------------------------------------
+
+SVG_DATA_URI = re.compile(r'''url\(\s*(['"]?)data:image/svg\+xml;base64,([A-Za-z0-9+/=\s]+)\1\s*\)''')
+
+
+def svg_compact(svg):
+    svg = re.sub(r'<\?xml.*?\?>', '', svg, flags=re.S)
+    svg = re.sub(r'<!DOCTYPE[^>]*>', '', svg, flags=re.S)
+    svg = re.sub(r'<!--.*?-->', '', svg, flags=re.S)
+    svg = re.sub(r'\s+(version="[^"]*"|xml:space="[^"]*")', '', svg)
+    svg = re.sub(r'style="([^"]*)"', lambda m: 'style="%s"' % re.sub(r'\s*([:;])\s*', r'\1', m.group(1)).rstrip(';'), svg)
+    svg = re.sub(r'>\s+<', '><', svg)
+    svg = re.sub(r'\s+', ' ', svg)
+    return svg.strip()
+
+
+def svg_data_uri(svg):
+    # single quotes inside, double quotes around: only the characters that break a URL or CSS are escaped
+    svg = svg_compact(svg).replace('"', "'")
+    for c, e in (('%', '%25'), ('#', '%23'), ('<', '%3C'), ('>', '%3E'), ('{', '%7B'), ('}', '%7D')):
+        svg = svg.replace(c, e)
+    return 'url("data:image/svg+xml,%s")' % svg
+
+
+def css_reencode_svg(css):
+    return SVG_DATA_URI.sub(lambda m: svg_data_uri(base64.b64decode(re.sub(r'\s', '', m.group(2))).decode('utf-8')), css)
+
+
+# ---- CSS ----------------------------------------------------------------------------------------
+
+CSS_TOKENS = re.compile(r'''("(?:\\.|[^"\\])*"|'(?:\\.|[^'\\])*'|/\*.*?\*/)''', re.S)
+
+
+def css_minify(css):
+    out = []
+    for i, token in enumerate(CSS_TOKENS.split(css)):
+        if i % 2:
+            if token.startswith('/*'):
+                # license notices are kept
+                if 'license' in token.lower():
+                    out.append(token)
+            else:
+                out.append(token)
+        else:
+            token = re.sub(r'\s+', ' ', token)
+            token = re.sub(r'\s*([{};,>~])\s*', r'\1', token)
+            token = re.sub(r'(?<=[{;])([a-z-]+) ?: ?', r'\1:', token)
+            out.append(token.replace(';}', '}'))
+    return ''.join(out).strip()
+
+
+# ---- JS -----------------------------------------------------------------------------------------
+
+JS_IDENT = re.compile(r'[A-Za-z0-9_$\\]')
+JS_REGEX_PREFIX = '(,=:[!&|?{};+-*%<>~^'
+JS_NO_NEWLINE_AFTER = '{;,([=:&|?<>*!'
+JS_NO_NEWLINE_BEFORE = '}),;.:?]'
+
+
+def js_minify(js):
+    """
+    Conservative minifier: comments and indentation are removed, line breaks are only dropped
+    where automatic semicolon insertion cannot depend on them. Strings, template literals and
+    regular expressions are copied as is.
+    """
+    out = []
+    i = 0
+    n = len(js)
+    pending_space = False
+    pending_newline = False
+    template_depth = []   # brace depth of each ${ } being parsed inside a template literal
+    depth = 0
+
+    def last():
+        return out[-1][-1] if out and out[-1] else ''
+
+    def emit(text):
+        if out and (pending_newline or pending_space):
+            prev = last()
+            if pending_newline and prev not in JS_NO_NEWLINE_AFTER and text[0] not in JS_NO_NEWLINE_BEFORE:
+                out.append('\n')
+            elif (JS_IDENT.match(prev) and JS_IDENT.match(text[0])) or (prev in '+-' and text[0] == prev):
+                out.append(' ')
+        out.append(text)
+
+    def scan_template(i):
+        # from just after a backtick (or the } closing a ${) to the closing backtick or the next ${
+        start = i
+        while i < n:
+            if js[i] == '\\':
+                i += 2
+            elif js[i] == '`':
+                return i + 1, js[start:i + 1], False
+            elif js.startswith('${', i):
+                return i + 2, js[start:i + 2], True
+            else:
+                i += 1
+        raise ValueError('unterminated template literal')
+
+    while i < n:
+        c = js[i]
+        if c in ' \t\r\n':
+            j = i
+            while j < n and js[j] in ' \t\r\n':
+                j += 1
+            if '\n' in js[i:j]:
+                pending_newline = True
+            else:
+                pending_space = True
+            i = j
+            continue
+        if js.startswith('//', i):
+            j = js.find('\n', i)
+            i = n if j < 0 else j
+            continue
+        if js.startswith('/*', i):
+            j = js.find('*/', i + 2)
+            if j < 0:
+                raise ValueError('unterminated comment')
+            i = j + 2
+            pending_space = True
+            continue
+        if c in '\'"':
+            j = i + 1
+            while j < n and js[j] != c:
+                if js[j] == '\\':
+                    j += 1
+                elif js[j] == '\n':
+                    raise ValueError('unterminated string')
+                j += 1
+            emit(js[i:j + 1])
+            i = j + 1
+        elif c == '`':
+            i, text, nested = scan_template(i + 1)
+            emit('`' + text)
+            if nested:
+                template_depth.append(depth)
+        elif c == '}' and template_depth and template_depth[-1] == depth:
+            template_depth.pop()
+            i, text, nested = scan_template(i + 1)
+            out.append('}' + text)
+            if nested:
+                template_depth.append(depth)
+        elif c == '/' and (not out or last() in JS_REGEX_PREFIX or re.search(r'\b(return|typeof|case|do|else|in|of)$', ''.join(out[-2:]))):
+            j = i + 1
+            in_class = False
+            while j < n and (js[j] != '/' or in_class):
+                if js[j] == '\\':
+                    j += 1
+                elif js[j] == '[':
+                    in_class = True
+                elif js[j] == ']':
+                    in_class = False
+                elif js[j] == '\n':
+                    raise ValueError('unterminated regular expression')
+                j += 1
+            j += 1
+            while j < n and js[j].isalpha():
+                j += 1
+            emit(js[i:j])
+            i = j
+        else:
+            j = i + 1
+            if JS_IDENT.match(c):
+                while j < n and JS_IDENT.match(js[j]):
+                    j += 1
+            if c == '{':
+                depth += 1
+            elif c == '}':
+                depth -= 1
+            emit(js[i:j])
+            i = j
+        pending_space = False
+        pending_newline = False
+
+    return ''.join(out).strip() + '\n'
+
+
+# ---- HTML ---------------------------------------------------------------------------------------
+
+def html_minify(html):
+    html = re.sub(r'<!--.*?-->', '', html, flags=re.S)
+    lines = [line.strip() for line in html.splitlines()]
+    return '\n'.join(line for line in lines if line) + '\n'
+
+
+def html_inline_css(html, css):
+    link = re.compile(r'<link\s+rel="stylesheet"\s+href="style\.css"\s*/?>')
+    if not link.search(html):
+        raise ValueError('index.html does not link style.css')
+    return link.sub(lambda m: '<style>%s</style>' % css, html, count=1)
+
+
+# ---- main ---------------------------------------------------------------------------------------
+
+def size_line(name, before, after):
+    deflated = len(zlib.compress(after.encode('utf-8'), 9))
+    return '%-12s %6d -> %6d bytes (%+.0f%%), %6d deflated' % (
+        name, before, len(after.encode('utf-8')), 100.0 * (len(after.encode('utf-8')) - before) / before, deflated)
+
+
+def main(argv):
+    if len(argv) < 3:
+        print('usage: %s <source dir> <output dir> [--no-minify]' % argv[0], file=sys.stderr)
+        return 1
+    src, dst = argv[1], argv[2]
+    minify = '--no-minify' not in argv[3:]
+
+    html_src = read(os.path.join(src, 'index.html'))
+    css_src = read(os.path.join(src, 'style.css'))
+    js_src = read(os.path.join(src, 'code.js'))
+
+    css = css_reencode_svg(css_src)
+    js = js_src
+    html = html_src
+    if minify:
+        css = css_minify(css)
+        js = js_minify(js)
+        html = html_minify(html)
+    html = html_inline_css(html, css)
+
+    if not os.path.isdir(dst):
+        os.makedirs(dst)
+    write(os.path.join(dst, 'index.html'), html)
+    write(os.path.join(dst, 'style.css'), css)
+    write(os.path.join(dst, 'code.js'), js)
+
+    def size(text):
+        return len(text.encode('utf-8'))
+
+    report = [
+        'web app size report%s' % ('' if minify else ' (not minified)'),
+        size_line('index.html', size(html_src), html),
+        size_line('style.css', size(css_src), css),
+        size_line('code.js', size(js_src), js),
+        'first paint: %d bytes in 1 request (was %d bytes in 2 requests)' % (size(html), size(html_src) + size(css_src)),
+    ]
+    write(os.path.join(dst, 'webapp_size.txt'), '\n'.join(report) + '\n')
+    print('\n'.join(report))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
@@ -22,13 +22,14 @@ function docReady(fn) {
 
 var selectedSSID = "";
 var refreshAPInterval = null;
-var checkStatusInterval = null;
+var apList = [];
+var apGeneration = 0;
+var checkStatusLoop = 0;
+var statusVersion = 0;
 
 function stopCheckStatusInterval() {
-  if (checkStatusInterval != null) {
-    clearInterval(checkStatusInterval);
-    checkStatusInterval = null;
-  }
+  // the running loop ends after its pending request
+  checkStatusLoop++;
 }
 
 function stopRefreshAPInterval() {
@@ -38,8 +39,14 @@ function stopRefreshAPInterval() {
   }
 }
 
-function startCheckStatusInterval() {
-  checkStatusInterval = setInterval(checkStatus, 950);
+async function startCheckStatusInterval() {
+  // long poll: each request is held by the server until the status changes, no need to wait between requests
+  const loop = ++checkStatusLoop;
+  while (loop === checkStatusLoop) {
+    if (!(await checkStatus())) {
+      await new Promise((r) => setTimeout(r, 950));
+    }
+  }
 }
 
 function startRefreshAPInterval() {
@@ -219,10 +226,8 @@ async function performConnect(conntype) {
     method: "POST",
     headers: {
       "Content-Type": "application/json",
-      "X-Custom-ssid": selectedSSID,
-      "X-Custom-pwd": pwd,
     },
-    body: { timestamp: Date.now() },
+    body: JSON.stringify({ ssid: selectedSSID, password: pwd }),
   });
 
   //now we can re-set the intervals regardless of result
@@ -242,10 +247,26 @@ function rssiToIcon(rssi) {
   }
 }
 
+// apply what changed in the access point list: removed entries first, then added and updated ones
+function applyAPDelta(list, delta) {
+  const same = (a, b) => a.ssid === b.ssid && a.auth === b.auth;
+  const changed = delta.removed.concat(delta.added, delta.updated);
+  return list
+    .filter((ap) => !changed.some((c) => same(ap, c)))
+    .concat(delta.added, delta.updated);
+}
+
 async function refreshAP(url = "ap.json") {
   try {
-    var res = await fetch(url);
-    var access_points = await res.json();
+    // only what changed since the last generation we got is sent back, or nothing at all (304)
+    var res = await fetch(`${url}?since=${apGeneration}`);
+    if (res.status === 304) {
+      return;
+    }
+    var data = await res.json();
+    apList = data.full ? data.aps : applyAPDelta(apList, data);
+    apGeneration = data.gen;
+    var access_points = apList.slice();
     if (access_points.length > 0) {
       //sort by signal strength
       access_points.sort((a, b) => {
@@ -274,8 +295,11 @@ function refreshAPHTML(data) {
 
 async function checkStatus(url = "status.json") {
   try {
-    var response = await fetch(url);
+    var response = await fetch(`${url}?wait=20000&version=${statusVersion}`);
     var data = await response.json();
+    if (data.hasOwnProperty("ver")) {
+      statusVersion = data["ver"];
+    }
     if (data && data.hasOwnProperty("ssid") && data["ssid"] != "") {
       if (data["ssid"] === selectedSSID) {
         // Attempting connection
@@ -348,5 +372,7 @@ async function checkStatus(url = "status.json") {
     }
   } catch (e) {
     console.info("Was not able to fetch /status.json");
+    return false;
   }
+  return true;
 }
@@ -0,0 +1,451 @@
+/**
+Copyright (c) 2020 Tony Pottier
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+@file diag.c
+@brief Diagnostics of the wifi manager: heap used per subsystem, stack usage of the tasks it spawns
+and time spent in each phase of a connection.
+
+@see https://idyl.io
+@see https://github.com/tonyp7/esp32-wifi-manager
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+#include "diag.h"
+
+
+/**
+ * @brief every block handed out by diag_malloc is prefixed by its size so diag_free knows how much to account for.
+ * The union keeps the user pointer aligned the same way malloc would.
+ */
+typedef union{
+	size_t size;
+	long long align_ll;
+	void *align_ptr;
+}diag_block_header_t;
+
+static const char *diag_heap_names[DIAG_HEAP_COUNT] = {
+	"wifi_manager",
+	"scan",
+	"json",
+	"http_app"
+};
+
+static const char *diag_task_names[DIAG_TASK_COUNT] = {
+	"wifi_manager",
+	"dns_server",
+	"httpd",
+	"wm_events"
+};
+
+static const char *diag_counter_names[DIAG_COUNTER_COUNT] = {
+	"http_requests",
+	"http_rejected",
+	"roaming_scans",
+	"handover_failed",
+	"ap_channel_moves"
+};
+
+static const char *diag_phase_names[DIAG_PHASE_COUNT] = {
+	"assoc",
+	"dhcp",
+	"connect",
+	"scan",
+	"boot",
+	"handover"
+};
+
+/* upper bounds in ms of the latency buckets. The last bucket catches everything above the last bound */
+static const uint32_t diag_latency_bounds[DIAG_LATENCY_BUCKET_COUNT - 1] = {
+	100, 250, 500, 1000, 2000, 3000, 5000, 8000, 15000
+};
+
+static diag_heap_usage_t diag_heap[DIAG_HEAP_COUNT];
+static diag_task_usage_t diag_task[DIAG_TASK_COUNT];
+static TaskHandle_t diag_task_handle[DIAG_TASK_COUNT];
+static uint32_t diag_counter[DIAG_COUNTER_COUNT];
+
+static diag_latency_report_t diag_latency;
+
+/* timestamps in us of the connection and scan in progress, 0 when nothing is in progress */
+static int64_t diag_connect_order_time = 0;
+static int64_t diag_sta_connected_time = 0;
+static int64_t diag_scan_order_time = 0;
+static int64_t diag_handover_order_time = 0;
+
+/* boot to IP is only measured once */
+static bool diag_boot_to_ip_done = false;
+
+/* timing of the last successful connection, waiting to be dispatched to the callback */
+static diag_connection_sample_t diag_connection_sample;
+static bool diag_connection_sample_pending = false;
+static void (*diag_connection_cb)(const diag_connection_sample_t*) = NULL;
+
+/* counters are updated from the wifi_manager task, the event loop task and the http server task */
+static portMUX_TYPE diag_mux = portMUX_INITIALIZER_UNLOCKED;
+
+
+
+void *diag_malloc(diag_heap_subsys_t subsys, size_t size){
+
+	diag_block_header_t *block = malloc(sizeof(diag_block_header_t) + size);
+	if(block == NULL){
+		return NULL;
+	}
+	block->size = size;
+
+	if(subsys < DIAG_HEAP_COUNT){
+		portENTER_CRITICAL(&diag_mux);
+		diag_heap[subsys].current += size;
+		diag_heap[subsys].allocs++;
+		if(diag_heap[subsys].current > diag_heap[subsys].peak){
+			diag_heap[subsys].peak = diag_heap[subsys].current;
+		}
+		portEXIT_CRITICAL(&diag_mux);
+	}
+
+	return block + 1;
+}
+
+void diag_free(diag_heap_subsys_t subsys, void *ptr){
+
+	if(ptr == NULL){
+		return;
+	}
+
+	diag_block_header_t *block = ((diag_block_header_t*)ptr) - 1;
+
+	if(subsys < DIAG_HEAP_COUNT){
+		portENTER_CRITICAL(&diag_mux);
+		diag_heap[subsys].current -= block->size;
+		diag_heap[subsys].frees++;
+		portEXIT_CRITICAL(&diag_mux);
+	}
+
+	free(block);
+}
+
+
+/**
+ * @brief records a new stack sample. Lower is worse: only the minimum is kept.
+ * @note ESP-IDF reports stack sizes and high water marks in bytes.
+ */
+static void diag_record_stack(diag_task_t task, uint32_t free_stack){
+	portENTER_CRITICAL(&diag_mux);
+	if(diag_task[task].high_water_mark == 0 || free_stack < diag_task[task].high_water_mark){
+		diag_task[task].high_water_mark = free_stack;
+	}
+	portEXIT_CRITICAL(&diag_mux);
+}
+
+void diag_register_task(diag_task_t task, TaskHandle_t handle, uint32_t stack_size){
+	if(task < DIAG_TASK_COUNT){
+		diag_task_handle[task] = handle;
+		diag_task[task].stack_size = stack_size;
+		diag_task[task].running = true;
+	}
+}
+
+void diag_unregister_task(diag_task_t task){
+	if(task < DIAG_TASK_COUNT){
+		if(diag_task_handle[task]){
+			diag_record_stack(task, (uint32_t)uxTaskGetStackHighWaterMark(diag_task_handle[task]));
+		}
+		diag_task_handle[task] = NULL;
+		diag_task[task].running = false;
+	}
+}
+
+void diag_sample_task(diag_task_t task){
+	if(task < DIAG_TASK_COUNT){
+		diag_record_stack(task, (uint32_t)uxTaskGetStackHighWaterMark(NULL));
+	}
+}
+
+
+void diag_get_memory_report(diag_memory_report_t *report){
+
+	/* refresh the tasks that can be reached from here */
+	for(int i=0; i<DIAG_TASK_COUNT; i++){
+		if(diag_task_handle[i]){
+			diag_record_stack((diag_task_t)i, (uint32_t)uxTaskGetStackHighWaterMark(diag_task_handle[i]));
+		}
+	}
+
+	portENTER_CRITICAL(&diag_mux);
+	memcpy(report->heap, diag_heap, sizeof(diag_heap));
+	memcpy(report->task, diag_task, sizeof(diag_task));
+	memcpy(report->counter, diag_counter, sizeof(diag_counter));
+	portEXIT_CRITICAL(&diag_mux);
+
+	report->free_heap = esp_get_free_heap_size();
+	report->minimum_free_heap = esp_get_minimum_free_heap_size();
+}
+
+
+void diag_count(diag_counter_t counter){
+	if(counter < DIAG_COUNTER_COUNT){
+		portENTER_CRITICAL(&diag_mux);
+		diag_counter[counter]++;
+		portEXIT_CRITICAL(&diag_mux);
+	}
+}
+
+
+bool diag_get_memory_json(json_writer_t *writer){
+
+	diag_memory_report_t report;
+
+	diag_get_memory_report(&report);
+
+	json_writer_begin_object(writer);
+	json_writer_key(writer, "free_heap");
+	json_writer_int(writer, (int32_t)report.free_heap);
+	json_writer_key(writer, "min_free_heap");
+	json_writer_int(writer, (int32_t)report.minimum_free_heap);
+
+	json_writer_key(writer, "heap");
+	json_writer_begin_array(writer);
+	for(int i=0; i<DIAG_HEAP_COUNT; i++){
+		json_writer_begin_object(writer);
+		json_writer_key(writer, "name");
+		json_writer_string(writer, diag_heap_names[i]);
+		json_writer_key(writer, "current");
+		json_writer_int(writer, (int32_t)report.heap[i].current);
+		json_writer_key(writer, "peak");
+		json_writer_int(writer, (int32_t)report.heap[i].peak);
+		json_writer_key(writer, "allocs");
+		json_writer_int(writer, (int32_t)report.heap[i].allocs);
+		json_writer_key(writer, "frees");
+		json_writer_int(writer, (int32_t)report.heap[i].frees);
+		json_writer_end_object(writer);
+	}
+	json_writer_end_array(writer);
+
+	json_writer_key(writer, "counters");
+	json_writer_begin_object(writer);
+	for(int i=0; i<DIAG_COUNTER_COUNT; i++){
+		json_writer_key(writer, diag_counter_names[i]);
+		json_writer_int(writer, (int32_t)report.counter[i]);
+	}
+	json_writer_end_object(writer);
+
+	json_writer_key(writer, "tasks");
+	json_writer_begin_array(writer);
+	for(int i=0; i<DIAG_TASK_COUNT; i++){
+		json_writer_begin_object(writer);
+		json_writer_key(writer, "name");
+		json_writer_string(writer, diag_task_names[i]);
+		json_writer_key(writer, "stack");
+		json_writer_int(writer, (int32_t)report.task[i].stack_size);
+		json_writer_key(writer, "hwm");
+		json_writer_int(writer, (int32_t)report.task[i].high_water_mark);
+		json_writer_key(writer, "running");
+		json_writer_bool(writer, report.task[i].running);
+		json_writer_end_object(writer);
+	}
+	json_writer_end_array(writer);
+
+	return json_writer_end_object(writer);
+}
+
+
+/**
+ * @brief adds a duration to the histogram of a phase.
+ * @note must be called inside the diag critical section.
+ */
+static void diag_record_latency(diag_phase_t phase, uint32_t ms){
+
+	diag_latency_histogram_t *h = &diag_latency.phase[phase];
+	int bucket = 0;
+
+	while(bucket < DIAG_LATENCY_BUCKET_COUNT - 1 && ms > diag_latency_bounds[bucket]){
+		bucket++;
+	}
+	h->buckets[bucket]++;
+
+	if(h->count == 0 || ms < h->min) h->min = ms;
+	if(ms > h->max) h->max = ms;
+	h->sum += ms;
+	h->last = ms;
+	h->count++;
+}
+
+static uint32_t diag_elapsed_ms(int64_t from, int64_t to){
+	return (uint32_t)((to - from) / 1000);
+}
+
+void diag_mark(diag_mark_t mark){
+
+	int64_t now = esp_timer_get_time();
+
+	portENTER_CRITICAL(&diag_mux);
+	switch(mark){
+
+	case DIAG_MARK_CONNECT_ORDER:
+		diag_connect_order_time = now;
+		diag_sta_connected_time = 0;
+		break;
+
+	case DIAG_MARK_STA_CONNECTED:
+		if(diag_connect_order_time){
+			diag_sta_connected_time = now;
+			diag_record_latency(DIAG_PHASE_ASSOC, diag_elapsed_ms(diag_connect_order_time, now));
+		}
+		break;
+
+	case DIAG_MARK_STA_GOT_IP:
+		/* a DHCP renewal while connected also raises GOT_IP: only a connection in progress counts */
+		if(diag_connect_order_time && diag_sta_connected_time){
+			diag_connection_sample.assoc_ms = diag_elapsed_ms(diag_connect_order_time, diag_sta_connected_time);
+			diag_connection_sample.dhcp_ms = diag_elapsed_ms(diag_sta_connected_time, now);
+			diag_connection_sample.connect_ms = diag_elapsed_ms(diag_connect_order_time, now);
+			diag_connection_sample_pending = true;
+			diag_record_latency(DIAG_PHASE_DHCP, diag_connection_sample.dhcp_ms);
+			diag_record_latency(DIAG_PHASE_CONNECT, diag_connection_sample.connect_ms);
+		}
+		diag_connect_order_time = 0;
+		diag_sta_connected_time = 0;
+
+		if(diag_handover_order_time){
+			diag_record_latency(DIAG_PHASE_HANDOVER, diag_elapsed_ms(diag_handover_order_time, now));
+			diag_handover_order_time = 0;
+		}
+
+		/* esp_timer counts from boot */
+		if(!diag_boot_to_ip_done){
+			diag_boot_to_ip_done = true;
+			diag_record_latency(DIAG_PHASE_BOOT, (uint32_t)(now / 1000));
+		}
+		break;
+
+	case DIAG_MARK_STA_DISCONNECTED:
+		if(diag_connect_order_time){
+			diag_latency.failed_attempts++;
+		}
+		diag_connect_order_time = 0;
+		diag_sta_connected_time = 0;
+		break;
+
+	case DIAG_MARK_SCAN_ORDER:
+		diag_scan_order_time = now;
+		break;
+
+	case DIAG_MARK_SCAN_DONE:
+		if(diag_scan_order_time){
+			diag_record_latency(DIAG_PHASE_SCAN, diag_elapsed_ms(diag_scan_order_time, now));
+		}
+		diag_scan_order_time = 0;
+		break;
+
+	case DIAG_MARK_HANDOVER_ORDER:
+		diag_handover_order_time = now;
+		break;
+
+	case DIAG_MARK_HANDOVER_FAILED:
+		if(diag_handover_order_time){
+			diag_counter[DIAG_COUNTER_HANDOVER_FAILED]++;
+		}
+		diag_handover_order_time = 0;
+		break;
+	}
+	portEXIT_CRITICAL(&diag_mux);
+}
+
+void diag_get_latency_report(diag_latency_report_t *report){
+	portENTER_CRITICAL(&diag_mux);
+	memcpy(report, &diag_latency, sizeof(diag_latency));
+	portEXIT_CRITICAL(&diag_mux);
+}
+
+bool diag_get_latency_json(json_writer_t *writer){
+
+	diag_latency_report_t report;
+
+	diag_get_latency_report(&report);
+
+	json_writer_begin_object(writer);
+	json_writer_key(writer, "failed_attempts");
+	json_writer_int(writer, (int32_t)report.failed_attempts);
+
+	json_writer_key(writer, "bounds");
+	json_writer_begin_array(writer);
+	for(int i=0; i<DIAG_LATENCY_BUCKET_COUNT - 1; i++){
+		json_writer_int(writer, (int32_t)diag_latency_bounds[i]);
+	}
+	json_writer_end_array(writer);
+
+	json_writer_key(writer, "phases");
+	json_writer_begin_array(writer);
+	for(int i=0; i<DIAG_PHASE_COUNT; i++){
+		diag_latency_histogram_t *h = &report.phase[i];
+		json_writer_begin_object(writer);
+		json_writer_key(writer, "name");
+		json_writer_string(writer, diag_phase_names[i]);
+		json_writer_key(writer, "count");
+		json_writer_int(writer, (int32_t)h->count);
+		json_writer_key(writer, "min");
+		json_writer_int(writer, (int32_t)h->min);
+		json_writer_key(writer, "max");
+		json_writer_int(writer, (int32_t)h->max);
+		json_writer_key(writer, "avg");
+		json_writer_int(writer, (int32_t)(h->count ? h->sum / h->count : 0));
+		json_writer_key(writer, "last");
+		json_writer_int(writer, (int32_t)h->last);
+		json_writer_key(writer, "buckets");
+		json_writer_begin_array(writer);
+		for(int j=0; j<DIAG_LATENCY_BUCKET_COUNT; j++){
+			json_writer_int(writer, (int32_t)h->buckets[j]);
+		}
+		json_writer_end_array(writer);
+		json_writer_end_object(writer);
+	}
+	json_writer_end_array(writer);
+
+	return json_writer_end_object(writer);
+}
+
+void diag_set_connection_callback(void (*func_ptr)(const diag_connection_sample_t*)){
+	diag_connection_cb = func_ptr;
+}
+
+void diag_dispatch_connection_sample(){
+
+	diag_connection_sample_t sample;
+	bool pending;
+
+	portENTER_CRITICAL(&diag_mux);
+	pending = diag_connection_sample_pending;
+	sample = diag_connection_sample;
+	diag_connection_sample_pending = false;
+	portEXIT_CRITICAL(&diag_mux);
+
+	if(pending && diag_connection_cb){
+		(*diag_connection_cb)(&sample);
+	}
+}
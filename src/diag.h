@@ -0,0 +1,261 @@
+/**
+Copyright (c) 2020 Tony Pottier
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+@file diag.h
+@brief Diagnostics of the wifi manager: heap used per subsystem, stack usage of the tasks it spawns
+and time spent in each phase of a connection.
+
+Every heap allocation made by the wifi manager goes through diag_malloc / diag_free so that the current
+and peak amount of memory used by each subsystem can be reported at any time.
+
+Connection phases are timestamped as they happen and aggregated into fixed-bucket histograms that are
+kept for the whole life of the program, across reconnections.
+
+@see https://idyl.io
+@see https://github.com/tonyp7/esp32-wifi-manager
+*/
+
+#ifndef WIFI_MANAGER_DIAG_H_INCLUDED
+#define WIFI_MANAGER_DIAG_H_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include "json.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/**
+ * @brief Number of buckets of a latency histogram. Bucket upper bounds are defined in diag.c, the last bucket has no upper bound.
+ */
+#define DIAG_LATENCY_BUCKET_COUNT			10
+
+
+/**
+ * @brief Subsystems of the wifi manager for which heap usage is accounted.
+ * @warning DIAG_HEAP_COUNT must always be the last element.
+ */
+typedef enum diag_heap_subsys_t {
+	DIAG_HEAP_WIFI_MANAGER = 0,	/* STA config, callback array, IP string... */
+	DIAG_HEAP_SCAN = 1,			/* wifi scan records */
+	DIAG_HEAP_JSON = 2,			/* JSON buffers served by the http server */
+	DIAG_HEAP_HTTP_APP = 3,		/* URLs, request headers and responses of the http server */
+	DIAG_HEAP_COUNT = 4
+}diag_heap_subsys_t;
+
+/**
+ * @brief Tasks spawned by the wifi manager for which stack usage is reported.
+ * @warning DIAG_TASK_COUNT must always be the last element.
+ */
+typedef enum diag_task_t {
+	DIAG_TASK_WIFI_MANAGER = 0,
+	DIAG_TASK_DNS_SERVER = 1,
+	DIAG_TASK_HTTPD = 2,
+	DIAG_TASK_EVENTS = 3,		/* wm_events: deferred subscribers of the wifi manager */
+	DIAG_TASK_COUNT = 4
+}diag_task_t;
+
+/**
+ * @brief Event counters of the wifi manager.
+ * @warning DIAG_COUNTER_COUNT must always be the last element.
+ */
+typedef enum diag_counter_t {
+	DIAG_COUNTER_HTTP_REQUESTS = 0,		/* requests received by the http server */
+	DIAG_COUNTER_HTTP_REJECTED = 1,		/* requests rejected by the per client rate limit */
+	DIAG_COUNTER_ROAMING_SCANS = 2,		/* scans made to find a stronger access point */
+	DIAG_COUNTER_HANDOVER_FAILED = 3,	/* handovers to another access point that did not end with an IP address */
+	DIAG_COUNTER_AP_CHANNEL_MOVES = 4,	/* access point moved to the channel of the STA */
+	DIAG_COUNTER_COUNT = 5
+}diag_counter_t;
+
+/**
+ * @brief Timed phases of the wifi manager.
+ * @warning DIAG_PHASE_COUNT must always be the last element.
+ */
+typedef enum diag_phase_t {
+	DIAG_PHASE_ASSOC = 0,	/* connection order to link up: scan, authentication, association and key handshake */
+	DIAG_PHASE_DHCP = 1,	/* link up to IP address obtained */
+	DIAG_PHASE_CONNECT = 2,	/* connection order to IP address obtained */
+	DIAG_PHASE_SCAN = 3,	/* scan order to scan done */
+	DIAG_PHASE_BOOT = 4,	/* boot to the first IP address obtained */
+	DIAG_PHASE_HANDOVER = 5,	/* handover order to IP address obtained from another access point */
+	DIAG_PHASE_COUNT = 6
+}diag_phase_t;
+
+/**
+ * @brief Points in time marked by the wifi manager to measure the phases.
+ */
+typedef enum diag_mark_t {
+	DIAG_MARK_CONNECT_ORDER = 0,
+	DIAG_MARK_STA_CONNECTED = 1,
+	DIAG_MARK_STA_GOT_IP = 2,
+	DIAG_MARK_STA_DISCONNECTED = 3,
+	DIAG_MARK_SCAN_ORDER = 4,
+	DIAG_MARK_SCAN_DONE = 5,
+	DIAG_MARK_HANDOVER_ORDER = 6,
+	DIAG_MARK_HANDOVER_FAILED = 7
+}diag_mark_t;
+
+/**
+ * @brief Timing of one successful connection, in ms.
+ */
+typedef struct{
+	uint32_t assoc_ms;
+	uint32_t dhcp_ms;
+	uint32_t connect_ms;
+}diag_connection_sample_t;
+
+/**
+ * @brief Latency histogram of one phase. Values are in ms.
+ */
+typedef struct{
+	uint32_t buckets[DIAG_LATENCY_BUCKET_COUNT];
+	uint32_t count;
+	uint32_t min;
+	uint32_t max;
+	uint32_t sum;
+	uint32_t last;
+}diag_latency_histogram_t;
+
+/**
+ * @brief Latency report of all phases.
+ * failed_attempts counts the connection orders that ended with a disconnection instead of an IP address.
+ */
+typedef struct{
+	diag_latency_histogram_t phase[DIAG_PHASE_COUNT];
+	uint32_t failed_attempts;
+}diag_latency_report_t;
+
+/**
+ * @brief Heap usage of one subsystem. Values are in bytes.
+ */
+typedef struct{
+	size_t current;
+	size_t peak;
+	uint32_t allocs;
+	uint32_t frees;
+}diag_heap_usage_t;
+
+/**
+ * @brief Stack usage of one task. Values are in bytes.
+ * high_water_mark is the minimum amount of stack that ever remained free, 0 if it was never sampled.
+ */
+typedef struct{
+	uint32_t stack_size;
+	uint32_t high_water_mark;
+	bool running;
+}diag_task_usage_t;
+
+/**
+ * @brief Complete memory report of the wifi manager.
+ */
+typedef struct{
+	diag_heap_usage_t heap[DIAG_HEAP_COUNT];
+	diag_task_usage_t task[DIAG_TASK_COUNT];
+	uint32_t counter[DIAG_COUNTER_COUNT];
+	uint32_t free_heap;
+	uint32_t minimum_free_heap;
+}diag_memory_report_t;
+
+
+/**
+ * @brief malloc accounted against a subsystem.
+ * @note memory allocated with diag_malloc must be released with diag_free using the same subsystem.
+ */
+void *diag_malloc(diag_heap_subsys_t subsys, size_t size);
+
+/**
+ * @brief free counterpart of diag_malloc. Freeing NULL is a no-op.
+ */
+void diag_free(diag_heap_subsys_t subsys, void *ptr);
+
+/**
+ * @brief Declares a task spawned by the wifi manager so its stack can be monitored.
+ * @param handle the task handle. NULL if the task cannot be reached from outside, in which case it must sample itself with diag_sample_task.
+ * @param stack_size the stack size in bytes the task was created with.
+ */
+void diag_register_task(diag_task_t task, TaskHandle_t handle, uint32_t stack_size);
+
+/**
+ * @brief Takes a last sample of the stack of a task that is about to be deleted. The high water mark is kept in the report.
+ */
+void diag_unregister_task(diag_task_t task);
+
+/**
+ * @brief Samples the stack high water mark of the calling task and records it under the given entry.
+ */
+void diag_sample_task(diag_task_t task);
+
+/**
+ * @brief Increments an event counter. Counters are part of the memory report.
+ */
+void diag_count(diag_counter_t counter);
+
+/**
+ * @brief Fills a memory report with the latest values.
+ */
+void diag_get_memory_report(diag_memory_report_t *report);
+
+/**
+ * @brief Prints the memory report as a JSON object.
+ * @return false if the writer failed.
+ */
+bool diag_get_memory_json(json_writer_t *writer);
+
+/**
+ * @brief Marks a point in time of a connection or a scan. Safe to call from the event loop.
+ * A phase is added to its histogram as soon as its end is marked.
+ */
+void diag_mark(diag_mark_t mark);
+
+/**
+ * @brief Fills a latency report with the histograms of all phases.
+ */
+void diag_get_latency_report(diag_latency_report_t *report);
+
+/**
+ * @brief Prints the latency report as a JSON object.
+ * @return false if the writer failed.
+ */
+bool diag_get_latency_json(json_writer_t *writer);
+
+/**
+ * @brief Register a function called with the timing of each successful connection.
+ * The callback runs in the wifi_manager task, like the callbacks registered with wifi_manager_set_callback.
+ */
+void diag_set_connection_callback(void (*func_ptr)(const diag_connection_sample_t*));
+
+/**
+ * @brief Runs the connection callback if a connection was completed since the last call.
+ */
+void diag_dispatch_connection_sample();
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* WIFI_MANAGER_DIAG_H_INCLUDED */
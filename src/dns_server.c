@@ -51,6 +51,7 @@ Contains the freeRTOS task for the DNS server that processes the requests.
 #include <byteswap.h>
 
 #include "wifi_manager.h"
+#include "diag.h"
 #include "dns_server.h"
 
 static const char TAG[] = "dns_server";
@@ -59,12 +60,14 @@ int socket_fd;
 
 void dns_server_start() {
 	if(task_dns_server == NULL){
-		xTaskCreate(&dns_server, "dns_server", 3072, NULL, WIFI_MANAGER_TASK_PRIORITY-1, &task_dns_server);
+		xTaskCreate(&dns_server, "dns_server", DNS_SERVER_TASK_STACK_SIZE, NULL, WIFI_MANAGER_TASK_PRIORITY-1, &task_dns_server);
+		diag_register_task(DIAG_TASK_DNS_SERVER, task_dns_server, DNS_SERVER_TASK_STACK_SIZE);
 	}
 }
 
 void dns_server_stop(){
 	if(task_dns_server){
+		diag_unregister_task(DIAG_TASK_DNS_SERVER);
 		vTaskDelete(task_dns_server);
 		close(socket_fd);
 		task_dns_server = NULL;
@@ -45,6 +45,9 @@ extern "C" {
 /** Query + 2 byte ptr, 2 byte type, 2 byte class, 4 byte TTL, 2 byte len, 4 byte data */
 #define	DNS_ANSWER_MAX_SIZE (DNS_QUERY_MAX_SIZE+16)
 
+/** Stack size in bytes of the DNS server task */
+#define DNS_SERVER_TASK_STACK_SIZE 3072
+
 
 /**
  * @brief RCODE values used in a DNS header message
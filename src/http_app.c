@@ -42,8 +42,12 @@ function to process requests, decode URLs, serve files, etc. etc.
 #include <esp_system.h>
 #include "esp_netif.h"
 #include <esp_http_server.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/timers.h>
+#include <lwip/sockets.h>
 
 #include "wifi_manager.h"
+#include "diag.h"
 #include "http_app.h"
 
 
@@ -53,19 +57,82 @@ static const char TAG[] = "http_server";
 /* @brief the HTTP server handle */
 static httpd_handle_t httpd_handle = NULL;
 
+/* @brief socket purge policy, see http_app_set_lru_purge */
+static bool http_app_lru_purge = false;
+
+/* @brief captive portal redirections, see http_app_set_captive_portal */
+static bool http_app_captive_portal = false;
+
+/* @brief time of the last activity of each open socket, used to find the least recently used one. fd is -1 for free slots */
+static struct{
+	int fd;
+	TickType_t last_activity;
+} http_app_sessions[HTTP_APP_MAX_OPEN_SOCKETS];
+
+/* @brief token bucket of each client IP. tokens are in thousandths of a request. ip is 0 for free slots.
+ * Only ever accessed from the httpd task */
+static struct{
+	uint32_t ip;
+	uint32_t tokens;
+	TickType_t last_refill;
+} http_app_clients[HTTP_APP_RATE_LIMIT_CLIENTS];
+
+/* @brief /status.json requests waiting for a change of status. fd is -1 for free slots.
+ * Only ever accessed from the httpd task: URI handlers and work queued with httpd_queue_work */
+static struct{
+	int fd;
+	uint32_t version;
+	TickType_t deadline;
+} http_app_status_waiters[HTTP_APP_MAX_OPEN_SOCKETS];
+
+/* @brief fires when the earliest waiting /status.json request times out */
+static TimerHandle_t http_app_status_timer = NULL;
+
+/* @brief IP of the access point, compared to the Host of requests */
+static uint32_t http_app_ap_ip = 0;
+
+/* @brief connectivity checks of the major OSes. With the captive portal on they are redirected to the portal right away */
+static const char * const http_app_probe_urls[] = {
+	"/generate_204",					/* Android, ChromeOS */
+	"/gen_204",							/* Android */
+	"/hotspot-detect.html",				/* iOS, macOS */
+	"/library/test/success.html",		/* iOS */
+	"/ncsi.txt",						/* Windows */
+	"/connecttest.txt"					/* Windows 10+ */
+};
+
 /* function pointers to URI handlers that can be user made */
 esp_err_t (*custom_get_httpd_uri_handler)(httpd_req_t *r) = NULL;
 esp_err_t (*custom_post_httpd_uri_handler)(httpd_req_t *r) = NULL;
 
 /* strings holding the URLs of the wifi manager */
 static char* http_root_url = NULL;
-static char* http_redirect_url = NULL;
+static char* http_redirect_response = NULL;	/* complete 302 response of the captive portal */
+static size_t http_redirect_response_len = 0;
 static char* http_js_url = NULL;
 static char* http_css_url = NULL;
 static char* http_connect_url = NULL;
 static char* http_ap_url = NULL;
+static char* http_ap_bin_url = NULL;
 static char* http_status_url = NULL;
+static char* http_diag_url = NULL;
+static char* http_latency_url = NULL;
+static char* http_power_url = NULL;
+static char* http_settings_url = NULL;
+static char* http_events_url = NULL;
 
+#ifdef HTTP_APP_PRECOMPUTED_RESPONSES
+/**
+ * @brief complete HTTP responses of the web app files: status line, headers and body.
+ * @see file "CMakeLists.txt" and "cmake/http_response.cmake"
+ */
+extern const char http_app_index_html_response[];
+extern const size_t http_app_index_html_response_len;
+extern const char http_app_code_js_response[];
+extern const size_t http_app_code_js_response_len;
+extern const char http_app_style_css_response[];
+extern const size_t http_app_style_css_response_len;
+#else
 /**
  * @brief embedded binary data.
  * @see file "component.mk"
@@ -77,24 +144,29 @@ extern const uint8_t code_js_start[] asm("_binary_code_js_start");
 extern const uint8_t code_js_end[] asm("_binary_code_js_end");
 extern const uint8_t index_html_start[] asm("_binary_index_html_start");
 extern const uint8_t index_html_end[] asm("_binary_index_html_end");
+#endif
 
 
 /* const httpd related values stored in ROM */
 const static char http_200_hdr[] = "200 OK";
 const static char http_302_hdr[] = "302 Found";
+const static char http_304_hdr[] = "304 Not Modified";
 const static char http_400_hdr[] = "400 Bad Request";
 const static char http_404_hdr[] = "404 Not Found";
+const static char http_429_hdr[] = "429 Too Many Requests";
 const static char http_503_hdr[] = "503 Service Unavailable";
 const static char http_location_hdr[] = "Location";
 const static char http_content_type_html[] = "text/html";
 const static char http_content_type_js[] = "text/javascript";
 const static char http_content_type_css[] = "text/css";
 const static char http_content_type_json[] = "application/json";
+const static char http_content_type_binary[] = "application/octet-stream";
 const static char http_cache_control_hdr[] = "Cache-Control";
 const static char http_cache_control_no_cache[] = "no-store, no-cache, must-revalidate, max-age=0";
 const static char http_cache_control_cache[] = "public, max-age=31536000";
 const static char http_pragma_hdr[] = "Pragma";
 const static char http_pragma_no_cache[] = "no-cache";
+const static char http_retry_after_hdr[] = "Retry-After";
 
 
 
@@ -115,8 +187,873 @@ esp_err_t http_app_set_handler_hook( httpd_method_t method,  esp_err_t (*handler
 }
 
 
+/**
+ * @brief marks the socket of a request as the most recently used.
+ */
+static void http_app_touch_session(httpd_req_t *req){
+	int fd = httpd_req_to_sockfd(req);
+	for(int i=0; i<HTTP_APP_MAX_OPEN_SOCKETS; i++){
+		if(http_app_sessions[i].fd == fd){
+			http_app_sessions[i].last_activity = xTaskGetTickCount();
+			break;
+		}
+	}
+}
+
+/**
+ * @brief called by the http server each time a client connects.
+ *
+ * esp_http_server can only purge sessions if told so when it is started. To be able to switch the policy while
+ * running, the server is started without purge and sessions are purged here instead: when the last free slot
+ * is taken, the least recently used session is closed so the next client finds room.
+ */
+static esp_err_t http_app_open_fn(httpd_handle_t hd, int sockfd){
+
+	int free_slot = -1, lru_slot = -1, open_sessions = 0;
+	TickType_t now = xTaskGetTickCount();
+	TickType_t lru_age = 0;
+
+	for(int i=0; i<HTTP_APP_MAX_OPEN_SOCKETS; i++){
+		if(http_app_sessions[i].fd == -1){
+			if(free_slot == -1) free_slot = i;
+		}
+		else{
+			/* unsigned arithmetic keeps the age right when the tick count wraps around */
+			TickType_t age = now - http_app_sessions[i].last_activity;
+			open_sessions++;
+			if(lru_slot == -1 || age > lru_age){
+				lru_slot = i;
+				lru_age = age;
+			}
+		}
+	}
+
+	if(free_slot != -1){
+		http_app_sessions[free_slot].fd = sockfd;
+		http_app_sessions[free_slot].last_activity = now;
+		open_sessions++;
+	}
+
+	if(http_app_lru_purge && open_sessions >= HTTP_APP_MAX_OPEN_SOCKETS && lru_slot != -1){
+		ESP_LOGD(TAG, "All sockets in use: closing least recently used socket %d", http_app_sessions[lru_slot].fd);
+		httpd_sess_trigger_close(hd, http_app_sessions[lru_slot].fd);
+	}
+
+	return ESP_OK;
+}
+
+/**
+ * @brief called by the http server each time a session is closed.
+ * @note when a close function is set, the socket must be closed by this function.
+ */
+static void http_app_close_fn(httpd_handle_t hd, int sockfd){
+	for(int i=0; i<HTTP_APP_MAX_OPEN_SOCKETS; i++){
+		if(http_app_sessions[i].fd == sockfd){
+			http_app_sessions[i].fd = -1;
+		}
+		if(http_app_status_waiters[i].fd == sockfd){
+			http_app_status_waiters[i].fd = -1;
+		}
+	}
+	close(sockfd);
+}
+
+
+/**
+ * @brief returns the IPv4 address of the client of a request, 0 if it cannot be found.
+ * IPv4 clients of a dual stack server are seen as IPv4-mapped IPv6 addresses.
+ */
+static uint32_t http_app_get_client_ip(httpd_req_t *req){
+
+	struct sockaddr_storage addr;
+	socklen_t addr_len = sizeof(addr);
+
+	if(getpeername(httpd_req_to_sockfd(req), (struct sockaddr*)&addr, &addr_len) != 0){
+		return 0;
+	}
+
+	if(addr.ss_family == AF_INET){
+		return ((struct sockaddr_in*)&addr)->sin_addr.s_addr;
+	}
+#if LWIP_IPV6
+	if(addr.ss_family == AF_INET6){
+		uint32_t ip;
+		memcpy(&ip, &((struct sockaddr_in6*)&addr)->sin6_addr.s6_addr[12], sizeof(ip));
+		return ip;
+	}
+#endif
+
+	return 0;
+}
+
+
+/**
+ * @brief token bucket admission of a request.
+ * @param retry_after set to the number of seconds before the client can make another request when it is rejected.
+ * @return true if the request can be served.
+ */
+static bool http_app_admit(httpd_req_t *req, uint32_t *retry_after){
+
+	const uint32_t burst = HTTP_APP_RATE_BURST * 1000;
+	TickType_t now = xTaskGetTickCount();
+	uint32_t ip;
+	int slot = -1, oldest = 0;
+
+	diag_count(DIAG_COUNTER_HTTP_REQUESTS);
+
+	if(HTTP_APP_RATE_LIMIT == 0 || (ip = http_app_get_client_ip(req)) == 0){
+		return true;
+	}
+
+	for(int i=0; i<HTTP_APP_RATE_LIMIT_CLIENTS; i++){
+		if(http_app_clients[i].ip == ip){
+			slot = i;
+			break;
+		}
+		if(http_app_clients[i].ip == 0 || (http_app_clients[oldest].ip != 0 &&
+				now - http_app_clients[i].last_refill > now - http_app_clients[oldest].last_refill)){
+			oldest = i;
+		}
+	}
+
+	if(slot == -1){
+		/* new client: starts with a full bucket, taking the place of a free slot or of the oldest client */
+		slot = oldest;
+		http_app_clients[slot].ip = ip;
+		http_app_clients[slot].tokens = burst;
+	}
+	else{
+		/* refill: HTTP_APP_RATE_LIMIT requests per second is as many thousandths of a request per ms */
+		uint32_t elapsed_ms = (now - http_app_clients[slot].last_refill) * portTICK_PERIOD_MS;
+		if(elapsed_ms > burst / HTTP_APP_RATE_LIMIT){
+			elapsed_ms = burst / HTTP_APP_RATE_LIMIT;
+		}
+		http_app_clients[slot].tokens += elapsed_ms * HTTP_APP_RATE_LIMIT;
+		if(http_app_clients[slot].tokens > burst){
+			http_app_clients[slot].tokens = burst;
+		}
+	}
+	http_app_clients[slot].last_refill = now;
+
+	if(http_app_clients[slot].tokens >= 1000){
+		http_app_clients[slot].tokens -= 1000;
+		return true;
+	}
+
+	/* time until a whole request is available, rounded up to the second */
+	*retry_after = ((1000 - http_app_clients[slot].tokens) / HTTP_APP_RATE_LIMIT + 999) / 1000;
+	if(*retry_after == 0){
+		*retry_after = 1;
+	}
+
+	diag_count(DIAG_COUNTER_HTTP_REJECTED);
+	return false;
+}
+
+
+/**
+ * @brief runs the rate limit on a request and answers it with 429 Too Many Requests if it is rejected.
+ * @return true if the request was rejected and answered.
+ */
+static bool http_app_reject(httpd_req_t *req){
+
+	uint32_t retry_after = 0;
+	char retry_after_str[11];
+
+	if(http_app_admit(req, &retry_after)){
+		return false;
+	}
+
+	ESP_LOGW(TAG, "%s rate limited, retry after %us", req->uri, (unsigned)retry_after);
+
+	snprintf(retry_after_str, sizeof(retry_after_str), "%u", (unsigned)retry_after);
+	httpd_resp_set_status(req, http_429_hdr);
+	httpd_resp_set_hdr(req, http_retry_after_hdr, retry_after_str);
+	httpd_resp_send(req, NULL, 0);
+
+	return true;
+}
+
+
+/**
+ * @brief writes a complete response, status line and headers included, on the socket of a request.
+ */
+static esp_err_t http_app_send_raw(httpd_req_t *req, const char *buf, size_t len){
+	while(len > 0){
+		int n = httpd_send(req, buf, len);
+		if(n < 0){
+			return ESP_FAIL;
+		}
+		buf += n;
+		len -= n;
+	}
+	return ESP_OK;
+}
+
+
+/**
+ * @brief tells if a request is the connectivity check of an OS.
+ */
+static bool http_app_is_probe(const char *uri){
+	for(int i=0; i<sizeof(http_app_probe_urls)/sizeof(http_app_probe_urls[0]); i++){
+		if(strcmp(uri, http_app_probe_urls[i]) == 0){
+			return true;
+		}
+	}
+	return false;
+}
+
+
+/**
+ * @brief tells if the Host of a request is one of the IP addresses of the device: the access point IP or the STA IP.
+ * The header is read in a stack buffer and compared as a number, the STA IP is read without its mutex.
+ * A request without a Host header is considered local.
+ */
+static bool http_app_host_is_local(httpd_req_t *req){
+
+	char host[48]; /* longest IPv4 with a port is 21 characters: anything longer is a name */
+	char *port;
+	uint32_t ip;
+
+	esp_err_t err = httpd_req_get_hdr_value_str(req, "Host", host, sizeof(host));
+	if(err == ESP_ERR_NOT_FOUND){
+		return true;
+	}
+	else if(err != ESP_OK){
+		return false;
+	}
+
+	port = strchr(host, ':');
+	if(port){
+		*port = '\0';
+	}
+
+	/* mDNS name of the device */
+	const char *hostname = wifi_manager_get_hostname();
+	size_t hostname_len = strlen(hostname);
+	if(strncasecmp(host, hostname, hostname_len) == 0 && strcasecmp(host + hostname_len, ".local") == 0){
+		return true;
+	}
+
+	if(inet_pton(AF_INET, host, &ip) != 1){
+		return false;
+	}
+
+	return ip == http_app_ap_ip || (ip != 0 && ip == wifi_manager_get_sta_ip());
+}
+
+
+/**
+ * @brief json_writer_t flush callback sending the buffer as one chunk of a chunked response.
+ */
+static bool http_app_send_json_chunk(void *ctx, const char *buf, size_t len){
+	return httpd_resp_send_chunk((httpd_req_t*)ctx, buf, len) == ESP_OK;
+}
+
+
+/**
+ * @brief streams a JSON document produced by a generator to the client, HTTP_APP_CHUNK_SIZE bytes at a time.
+ */
+static esp_err_t http_app_send_json(httpd_req_t *req, bool (*generator)(json_writer_t*)){
+
+	char chunk[HTTP_APP_CHUNK_SIZE];
+	json_writer_t writer;
+
+	httpd_resp_set_status(req, http_200_hdr);
+	httpd_resp_set_type(req, http_content_type_json);
+	httpd_resp_set_hdr(req, http_cache_control_hdr, http_cache_control_no_cache);
+	httpd_resp_set_hdr(req, http_pragma_hdr, http_pragma_no_cache);
+
+	json_writer_init(&writer, chunk, sizeof(chunk), http_app_send_json_chunk, req);
+	(*generator)(&writer);
+	if(!json_writer_finish(&writer)){
+		/* headers are already sent: the only thing left to do is to cut the response short */
+		ESP_LOGE(TAG, "http_app_send_json: failed after %d bytes", (int)writer.total);
+	}
+
+	/* zero length chunk terminates the response */
+	return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+
+/**
+ * @brief a JSON document rendered in memory. buffer is NULL while the document is only measured.
+ */
+typedef struct{
+	char *buffer;
+	size_t len;
+	size_t size;
+}http_app_render_t;
+
+/**
+ * @brief json_writer_t flush callback appending the buffer to a http_app_render_t.
+ */
+static bool http_app_render_flush(void *ctx, const char *buf, size_t len){
+
+	http_app_render_t *render = (http_app_render_t*)ctx;
+
+	if(render->buffer){
+		if(render->len + len > render->size){
+			return false;
+		}
+		memcpy(render->buffer + render->len, buf, len);
+	}
+	render->len += len;
+
+	return true;
+}
+
+/**
+ * @brief renders a JSON document in a heap buffer, so that it can be sent once the mutex guarding its data is released.
+ * The generator runs twice: once to measure the document, once to write it.
+ * @return the document, to be released with diag_free(DIAG_HEAP_HTTP_APP, ...). NULL if the generator failed or memory is short.
+ */
+static char* http_app_render_json(bool (*generator)(json_writer_t*), size_t *len){
+
+	char chunk[HTTP_APP_CHUNK_SIZE];
+	json_writer_t writer;
+	http_app_render_t render = { NULL, 0, 0 };
+
+	json_writer_init(&writer, chunk, sizeof(chunk), http_app_render_flush, &render);
+	(*generator)(&writer);
+	if(!json_writer_finish(&writer) || render.len == 0){
+		return NULL;
+	}
+
+	render.size = render.len;
+	render.len = 0;
+	render.buffer = diag_malloc(DIAG_HEAP_HTTP_APP, render.size);
+	if(render.buffer == NULL){
+		return NULL;
+	}
+
+	json_writer_init(&writer, chunk, sizeof(chunk), http_app_render_flush, &render);
+	(*generator)(&writer);
+	if(!json_writer_finish(&writer) || render.len != render.size){
+		diag_free(DIAG_HEAP_HTTP_APP, render.buffer);
+		return NULL;
+	}
+
+	*len = render.len;
+	return render.buffer;
+}
+
+/**
+ * @brief sends a response rendered in memory, then releases it.
+ */
+static esp_err_t http_app_send_rendered(httpd_req_t *req, const char *type, char *buf, size_t len){
+
+	httpd_resp_set_status(req, http_200_hdr);
+	httpd_resp_set_type(req, type);
+	httpd_resp_set_hdr(req, http_cache_control_hdr, http_cache_control_no_cache);
+	httpd_resp_set_hdr(req, http_pragma_hdr, http_pragma_no_cache);
+	esp_err_t err = httpd_resp_send(req, buf, len);
+
+	diag_free(DIAG_HEAP_HTTP_APP, buf);
+	return err;
+}
+
+
+/**
+ * @brief compares the path of a request to a URL, ignoring the query string.
+ */
+static bool http_app_path_equals(const char *uri, const char *url){
+	size_t len = strlen(url);
+	return strncmp(uri, url, len) == 0 && (uri[len] == '\0' || uri[len] == '?');
+}
+
+
+/**
+ * @brief reads an unsigned integer parameter of the query string.
+ * @return false if the parameter is absent or is not a number.
+ */
+static bool http_app_get_query_uint(httpd_req_t *req, const char *key, uint32_t *value){
+
+	char query[64];
+	char param[12];
+	char *end = NULL;
+
+	if(httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK ||
+		httpd_query_key_value(query, key, param, sizeof(param)) != ESP_OK ||
+		param[0] == '\0'){
+		return false;
+	}
+
+	unsigned long v = strtoul(param, &end, 10);
+	if(*end != '\0'){
+		return false;
+	}
+
+	*value = (uint32_t)v;
+	return true;
+}
+
+
+/**
+ * @brief sends the connection status on a socket whose request was parked. There is no httpd_req_t anymore
+ * so the whole response is written on the socket.
+ * @param json copy of the status taken under the json mutex, which must not be held here.
+ */
+static void http_app_send_status_raw(int fd, const char *json, size_t len){
+
+	char hdr[256];
+
+	int n = snprintf(hdr, sizeof(hdr), "HTTP/1.1 %s\r\nContent-Type: %s\r\n%s: %s\r\n%s: %s\r\nContent-Length: %u\r\n\r\n",
+			http_200_hdr,
+			http_content_type_json,
+			http_cache_control_hdr, http_cache_control_no_cache,
+			http_pragma_hdr, http_pragma_no_cache,
+			(unsigned)len);
+
+	if(httpd_socket_send(httpd_handle, fd, hdr, n, 0) < 0 || httpd_socket_send(httpd_handle, fd, json, len, 0) < 0){
+		ESP_LOGE(TAG, "http_app_send_status_raw: failed to answer socket %d", fd);
+	}
+}
+
+
+/**
+ * @brief answers the waiting /status.json requests whose version is outdated or whose wait is over, and arms the
+ * timer for the next one to time out.
+ * @note runs in the httpd task, queued with httpd_queue_work.
+ */
+static void http_app_release_status_waiters(void *arg){
+
+	TickType_t now = xTaskGetTickCount();
+	TickType_t next = portMAX_DELAY;
+
+	if(!wifi_manager_lock_json_buffer(( TickType_t ) 10)){
+		/* try again a bit later */
+		xTimerChangePeriod(http_app_status_timer, pdMS_TO_TICKS(50), 0);
+		return;
+	}
+
+	/* the waiters to answer and a copy of the status are taken under the mutex, the sockets are written once it is
+	 * released: a stalled client cannot hold up the wifi manager */
+	int release[HTTP_APP_MAX_OPEN_SOCKETS];
+	int count = 0;
+	char *json = NULL;
+	size_t len = 0;
+
+	uint32_t version = wifi_manager_get_ip_info_json_version();
+	for(int i=0; i<HTTP_APP_MAX_OPEN_SOCKETS; i++){
+		if(http_app_status_waiters[i].fd == -1){
+			continue;
+		}
+
+		TickType_t remaining = http_app_status_waiters[i].deadline - now;
+		if(http_app_status_waiters[i].version != version || (int32_t)remaining <= 0){
+			release[count++] = i;
+		}
+		else if(remaining < next){
+			next = remaining;
+		}
+	}
+
+	if(count > 0){
+		const char *status = wifi_manager_get_ip_info_json();
+		len = strlen(status);
+		json = (char*)diag_malloc(DIAG_HEAP_HTTP_APP, len);
+		if(json == NULL){
+			/* the waiters stay parked, try again a bit later */
+			wifi_manager_unlock_json_buffer();
+			xTimerChangePeriod(http_app_status_timer, pdMS_TO_TICKS(50), 0);
+			return;
+		}
+		memcpy(json, status, len);
+
+		for(int i=0; i<count; i++){
+			int slot = release[i];
+			release[i] = http_app_status_waiters[slot].fd;
+			http_app_status_waiters[slot].fd = -1;
+		}
+	}
+
+	wifi_manager_unlock_json_buffer();
+
+	for(int i=0; i<count; i++){
+		http_app_send_status_raw(release[i], json, len);
+	}
+	if(json){
+		diag_free(DIAG_HEAP_HTTP_APP, json);
+	}
+
+	if(next != portMAX_DELAY){
+		xTimerChangePeriod(http_app_status_timer, next, 0);
+	}
+	else{
+		xTimerStop(http_app_status_timer, 0);
+	}
+}
+
+
+static void http_app_status_timer_cb(TimerHandle_t xTimer){
+	if(httpd_handle != NULL){
+		httpd_queue_work(httpd_handle, http_app_release_status_waiters, NULL);
+	}
+}
+
+
+void http_app_notify_status_changed(){
+	if(httpd_handle != NULL){
+		httpd_queue_work(httpd_handle, http_app_release_status_waiters, NULL);
+	}
+}
+
+
+/**
+ * @brief parks a /status.json request until the status moves past version or wait_ms elapsed. The handler then
+ * returns without a response, which is sent later by http_app_release_status_waiters.
+ * @return false if the request must be answered right away: status already changed or too many waiting requests.
+ */
+static bool http_app_park_status_request(httpd_req_t *req, uint32_t version, uint32_t wait_ms){
+
+	bool outdated = true;
+
+	if(wifi_manager_lock_json_buffer(( TickType_t ) 10)){
+		outdated = version != wifi_manager_get_ip_info_json_version();
+		wifi_manager_unlock_json_buffer();
+	}
+	if(outdated || http_app_status_timer == NULL){
+		return false;
+	}
+
+	for(int i=0; i<HTTP_APP_MAX_OPEN_SOCKETS; i++){
+		if(http_app_status_waiters[i].fd == -1){
+			if(wait_ms > HTTP_APP_STATUS_MAX_WAIT_MS){
+				wait_ms = HTTP_APP_STATUS_MAX_WAIT_MS;
+			}
+			http_app_status_waiters[i].fd = httpd_req_to_sockfd(req);
+			http_app_status_waiters[i].version = version;
+			http_app_status_waiters[i].deadline = xTaskGetTickCount() + pdMS_TO_TICKS(wait_ms);
+
+			/* the release arms the timer on the earliest deadline */
+			http_app_notify_status_changed();
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+/* generation requested by the /ap.json request being served. Requests are served one at a time by the httpd task */
+static uint32_t http_app_ap_list_since = 0;
+
+static bool http_app_get_ap_list_delta_json(json_writer_t *writer){
+	return wifi_manager_get_ap_list_delta_json(writer, http_app_ap_list_since);
+}
+
+
+/* connection request reported by the /connect.json request being served */
+static uint32_t http_app_connect_id = 0;
+
+static bool http_app_get_connect_json(json_writer_t *writer){
+	json_writer_begin_object(writer);
+	json_writer_key(writer, "id");
+	json_writer_int(writer, (int32_t)http_app_connect_id);
+	json_writer_key(writer, "status");
+	json_writer_string(writer, wifi_manager_get_connect_status_name(wifi_manager_get_connect_status(http_app_connect_id)));
+	return json_writer_end_object(writer);
+}
+
+
+/**
+ * @brief copies the binary access point list into a heap buffer, so that it can be sent once the json mutex is released.
+ * @note must be called with the json mutex taken.
+ * @return the list, to be released with diag_free(DIAG_HEAP_HTTP_APP, ...). NULL if memory is short.
+ */
+static uint8_t* http_app_render_ap_list_bin(size_t *len){
+
+	uint8_t *buf = diag_malloc(DIAG_HEAP_HTTP_APP, AP_LIST_BIN_HEADER_SIZE + MAX_AP_NUM * AP_LIST_BIN_RECORD_MAX_SIZE);
+	size_t n;
+
+	if(buf == NULL){
+		return NULL;
+	}
+
+	*len = wifi_manager_get_ap_list_bin_header(buf);
+	for(uint16_t i=0; i<MAX_AP_NUM; i++){
+		n = wifi_manager_get_ap_list_bin_record(i, buf + *len);
+		if(n == 0){
+			break;
+		}
+		*len += n;
+	}
+
+	return buf;
+}
+
+
+/**
+ * @brief a connection request read from a JSON body.
+ */
+typedef struct{
+	wifi_manager_connect_request_t request;
+	bool ssid_set;
+	bool netmask_set;
+}http_app_connect_body_t;
+
+/**
+ * @brief fills a connection request with a member of the JSON body of POST /connect.json.
+ * Unknown members are ignored so that clients can send more than this version knows about.
+ */
+static bool http_app_connect_member(void *ctx, const char *key, const char *value, bool is_string){
+
+	http_app_connect_body_t *body = (http_app_connect_body_t*)ctx;
+	wifi_manager_connect_request_t *request = &body->request;
+	size_t len = strlen(value);
+
+	if(strcmp(key, "ssid") == 0){
+		if(!is_string || len == 0 || len > MAX_SSID_SIZE){
+			return false;
+		}
+		/* a repeated member replaces the previous value whole */
+		memset(request->ssid, 0x00, sizeof(request->ssid));
+		memcpy(request->ssid, value, len);
+		body->ssid_set = true;
+	}
+	else if(strcmp(key, "password") == 0){
+		if(!is_string || len > MAX_PASSWORD_SIZE){
+			return false;
+		}
+		memset(request->password, 0x00, sizeof(request->password));
+		memcpy(request->password, value, len);
+	}
+	else if(strcmp(key, "bssid") == 0){
+		unsigned int b[6];
+		char extra;
+		if(!is_string || sscanf(value, "%2x:%2x:%2x:%2x:%2x:%2x%c", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5], &extra) != 6){
+			return false;
+		}
+		for(int i=0; i<6; i++){
+			request->bssid[i] = (uint8_t)b[i];
+		}
+		request->bssid_set = true;
+	}
+	else if(strcmp(key, "ip") == 0){
+		/* an address for a static IP, "" or null for DHCP */
+		if(!is_string && strcmp(value, "null") != 0){
+			return false;
+		}
+		request->ip_set = true;
+		request->static_ip = is_string && len > 0;
+		if(request->static_ip && inet_pton(AF_INET, value, &request->ip_info.ip) != 1){
+			return false;
+		}
+	}
+	else if(strcmp(key, "netmask") == 0){
+		if(!is_string || inet_pton(AF_INET, value, &request->ip_info.netmask) != 1){
+			return false;
+		}
+		body->netmask_set = true;
+	}
+	else if(strcmp(key, "gw") == 0){
+		if(!is_string || inet_pton(AF_INET, value, &request->ip_info.gw) != 1){
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * @brief parses a JSON body as it is received, a few bytes at a time: the body is never held in memory as a whole.
+ * @return true if the body is a complete JSON object of at most HTTP_APP_MAX_BODY_SIZE bytes.
+ */
+static bool http_app_read_json_body(httpd_req_t *req, json_reader_t *reader){
+
+	char buf[64];
+	size_t left = req->content_len;
+	int timeouts = 0;
+
+	if(left == 0 || left > HTTP_APP_MAX_BODY_SIZE){
+		return false;
+	}
+
+	while(left > 0){
+		int n = httpd_req_recv(req, buf, left < sizeof(buf) ? left : sizeof(buf));
+		if(n == HTTPD_SOCK_ERR_TIMEOUT && ++timeouts < 3){
+			continue;
+		}
+		if(n <= 0 || !json_reader_feed(reader, buf, (size_t)n)){
+			memset(buf, 0x00, sizeof(buf));
+			return false;
+		}
+		left -= (size_t)n;
+	}
+
+	/* the last piece may hold the password */
+	memset(buf, 0x00, sizeof(buf));
+	return json_reader_finish(reader);
+}
+
+/**
+ * @brief reads a JSON literal true or false.
+ */
+static bool http_app_parse_bool(const char *value, bool is_string, bool *b){
+	if(is_string){
+		return false;
+	}
+	*b = strcmp(value, "true") == 0;
+	return *b || strcmp(value, "false") == 0;
+}
+
+/**
+ * @brief adds a member of the JSON body of PATCH /settings.json to a change set. Only the type is checked here: ranges are
+ * checked by wifi_manager_update_settings_async. Unknown members are ignored, like in POST /connect.json.
+ */
+static bool http_app_settings_member(void *ctx, const char *key, const char *value, bool is_string){
+
+	wifi_manager_settings_change_t *change = (wifi_manager_settings_change_t*)ctx;
+	struct wifi_settings_t *settings = &change->settings;
+	size_t len = strlen(value);
+	char *end;
+	long n;
+	bool b;
+
+	if(strcmp(key, "ap_ssid") == 0){
+		if(!is_string || len >= sizeof(settings->ap_ssid)){
+			return false;
+		}
+		memset(settings->ap_ssid, 0x00, sizeof(settings->ap_ssid));
+		memcpy(settings->ap_ssid, value, len);
+		change->fields |= WM_SETTING_AP_SSID;
+	}
+	else if(strcmp(key, "ap_pwd") == 0){
+		if(!is_string || len >= sizeof(settings->ap_pwd)){
+			return false;
+		}
+		memset(settings->ap_pwd, 0x00, sizeof(settings->ap_pwd));
+		memcpy(settings->ap_pwd, value, len);
+		change->fields |= WM_SETTING_AP_PWD;
+	}
+	else if(strcmp(key, "ap_channel") == 0){
+		n = strtol(value, &end, 10);
+		if(is_string || *end != '\0' || n < 0 || n > UINT8_MAX){
+			return false;
+		}
+		settings->ap_channel = (uint8_t)n;
+		change->fields |= WM_SETTING_AP_CHANNEL;
+	}
+	else if(strcmp(key, "ap_ssid_hidden") == 0){
+		if(!http_app_parse_bool(value, is_string, &b)){
+			return false;
+		}
+		settings->ap_ssid_hidden = b;
+		change->fields |= WM_SETTING_AP_SSID_HIDDEN;
+	}
+	else if(strcmp(key, "ap_bandwidth") == 0){
+		/* in MHz */
+		if(is_string || (strcmp(value, "20") != 0 && strcmp(value, "40") != 0)){
+			return false;
+		}
+		settings->ap_bandwidth = value[0] == '4' ? WIFI_BW_HT40 : WIFI_BW_HT20;
+		change->fields |= WM_SETTING_AP_BANDWIDTH;
+	}
+	else if(strcmp(key, "sta_only") == 0){
+		if(!http_app_parse_bool(value, is_string, &settings->sta_only)){
+			return false;
+		}
+		change->fields |= WM_SETTING_STA_ONLY;
+	}
+	else if(strcmp(key, "sta_power_save") == 0){
+		if(!is_string || !wifi_manager_get_power_save_by_name(value, &settings->sta_power_save)){
+			return false;
+		}
+		change->fields |= WM_SETTING_STA_POWER_SAVE;
+	}
+	else if(strcmp(key, "sta_static_ip") == 0){
+		if(!http_app_parse_bool(value, is_string, &settings->sta_static_ip)){
+			return false;
+		}
+		change->fields |= WM_SETTING_STA_STATIC_IP;
+	}
+	else if(strcmp(key, "sta_ip") == 0){
+		if(!is_string || inet_pton(AF_INET, value, &settings->sta_static_ip_config.ip) != 1){
+			return false;
+		}
+		change->fields |= WM_SETTING_STA_IP;
+	}
+	else if(strcmp(key, "sta_netmask") == 0){
+		if(!is_string || inet_pton(AF_INET, value, &settings->sta_static_ip_config.netmask) != 1){
+			return false;
+		}
+		change->fields |= WM_SETTING_STA_NETMASK;
+	}
+	else if(strcmp(key, "sta_gw") == 0){
+		if(!is_string || inet_pton(AF_INET, value, &settings->sta_static_ip_config.gw) != 1){
+			return false;
+		}
+		change->fields |= WM_SETTING_STA_GW;
+	}
+
+	return true;
+}
+
+
+static esp_err_t http_server_patch_handler(httpd_req_t *req){
+
+	http_app_touch_session(req);
+
+	if(http_app_reject(req)){
+		return ESP_OK;
+	}
+
+	ESP_LOGI(TAG, "PATCH %s", req->uri);
+
+	/* PATCH /settings.json: only the members of the body are changed */
+	if(strcmp(req->uri, http_settings_url) == 0){
+
+		wifi_manager_settings_change_t change;
+		json_reader_t reader;
+		esp_err_t err = ESP_ERR_INVALID_ARG;
+		memset(&change, 0x00, sizeof(change));
+
+		json_reader_init(&reader, http_app_settings_member, &change);
+		if(http_app_read_json_body(req, &reader)){
+			err = wifi_manager_update_settings_async(&change);
+		}
+
+		/* the reader and the change set may still hold the password of the access point */
+		memset(&reader, 0x00, sizeof(reader));
+		memset(change.settings.ap_pwd, 0x00, sizeof(change.settings.ap_pwd));
+
+		if(err == ESP_OK){
+			httpd_resp_set_status(req, http_200_hdr);
+			httpd_resp_set_type(req, http_content_type_json);
+			httpd_resp_set_hdr(req, http_cache_control_hdr, http_cache_control_no_cache);
+			httpd_resp_set_hdr(req, http_pragma_hdr, http_pragma_no_cache);
+			httpd_resp_send(req, NULL, 0);
+		}
+		else if(err == ESP_ERR_TIMEOUT){
+			/* the wifi manager is busy: the client can try again shortly */
+			httpd_resp_set_status(req, http_503_hdr);
+			httpd_resp_set_hdr(req, http_retry_after_hdr, "1");
+			httpd_resp_send(req, NULL, 0);
+		}
+		else{
+			/* bad request: not a JSON object, or a member of the wrong type or out of range */
+			httpd_resp_set_status(req, http_400_hdr);
+			httpd_resp_send(req, NULL, 0);
+		}
+	}
+	else{
+		httpd_resp_set_status(req, http_404_hdr);
+		httpd_resp_send(req, NULL, 0);
+	}
+
+	return ESP_OK;
+}
+
+
 static esp_err_t http_server_delete_handler(httpd_req_t *req){
 
+	http_app_touch_session(req);
+
+	if(http_app_reject(req)){
+		return ESP_OK;
+	}
+
 	ESP_LOGI(TAG, "DELETE %s", req->uri);
 
 	/* DELETE /connect.json */
@@ -140,6 +1077,11 @@ static esp_err_t http_server_delete_handler(httpd_req_t *req){
 
 static esp_err_t http_server_post_handler(httpd_req_t *req){
 
+	http_app_touch_session(req);
+
+	if(http_app_reject(req)){
+		return ESP_OK;
+	}
 
 	esp_err_t ret = ESP_OK;
 
@@ -149,48 +1091,87 @@ static esp_err_t http_server_post_handler(httpd_req_t *req){
 	if(strcmp(req->uri, http_connect_url) == 0){
 
 
-		/* buffers for the headers */
-		size_t ssid_len = 0, password_len = 0;
-		char *ssid = NULL, *password = NULL;
+		/* the request is copied into a message for the wifi_manager task: nothing outlives the handler */
+		http_app_connect_body_t body;
+		bool valid;
+		memset(&body, 0x00, sizeof(body));
 
-		/* len of values provided */
-		ssid_len = httpd_req_get_hdr_value_len(req, "X-Custom-ssid");
-		password_len = httpd_req_get_hdr_value_len(req, "X-Custom-pwd");
+		size_t ssid_len = httpd_req_get_hdr_value_len(req, "X-Custom-ssid");
 
+		if(ssid_len == 0 && req->content_len > 0){
+			/* JSON body: {"ssid":"...","password":"...","bssid":"aa:bb:cc:dd:ee:ff","ip":"...","netmask":"...","gw":"..."} */
+			json_reader_t reader;
+			json_reader_init(&reader, http_app_connect_member, &body);
+			valid = http_app_read_json_body(req, &reader) && body.ssid_set;
 
-		if(ssid_len && ssid_len <= MAX_SSID_SIZE && password_len && password_len <= MAX_PASSWORD_SIZE){
+			/* the reader may still hold the password */
+			memset(&reader, 0x00, sizeof(reader));
 
-			/* get the actual value of the headers */
-			ssid = malloc(sizeof(char) * (ssid_len + 1));
-			password = malloc(sizeof(char) * (password_len + 1));
-			httpd_req_get_hdr_value_str(req, "X-Custom-ssid", ssid, ssid_len+1);
-			httpd_req_get_hdr_value_str(req, "X-Custom-pwd", password, password_len+1);
+			if(valid && body.request.static_ip && !body.netmask_set){
+				inet_pton(AF_INET, "255.255.255.0", &body.request.ip_info.netmask);
+			}
+		}
+		else{
+			/* X-Custom-ssid and X-Custom-pwd headers */
+			size_t password_len = httpd_req_get_hdr_value_len(req, "X-Custom-pwd");
 
-			wifi_config_t* config = wifi_manager_get_wifi_sta_config();
-			memset(config, 0x00, sizeof(wifi_config_t));
-			memcpy(config->sta.ssid, ssid, ssid_len);
-			memcpy(config->sta.password, password, password_len);
-			ESP_LOGI(TAG, "ssid: %s, password: %s", ssid, password);
-			ESP_LOGD(TAG, "http_server_post_handler: wifi_manager_connect_async() call");
-			wifi_manager_connect_async();
+			valid = ssid_len && ssid_len <= MAX_SSID_SIZE && password_len && password_len <= MAX_PASSWORD_SIZE &&
+				httpd_req_get_hdr_value_str(req, "X-Custom-ssid", (char*)body.request.ssid, sizeof(body.request.ssid)) == ESP_OK &&
+				httpd_req_get_hdr_value_str(req, "X-Custom-pwd", (char*)body.request.password, sizeof(body.request.password)) == ESP_OK;
+		}
 
-			/* free memory */
-			free(ssid);
-			free(password);
+		if(valid){
+			http_app_connect_id = wifi_manager_submit_connect_request(&body.request);
+			memset(body.request.password, 0x00, sizeof(body.request.password));
 
-			httpd_resp_set_status(req, http_200_hdr);
-			httpd_resp_set_type(req, http_content_type_json);
-			httpd_resp_set_hdr(req, http_cache_control_hdr, http_cache_control_no_cache);
-			httpd_resp_set_hdr(req, http_pragma_hdr, http_pragma_no_cache);
+			if(http_app_connect_id){
+				ESP_LOGI(TAG, "connection request %u: ssid: %s", (unsigned)http_app_connect_id, (char*)body.request.ssid);
+				http_app_send_json(req, http_app_get_connect_json);
+			}
+			else{
+				/* the wifi manager is busy: the client can try again shortly */
+				httpd_resp_set_status(req, http_503_hdr);
+				httpd_resp_set_hdr(req, http_retry_after_hdr, "1");
+				httpd_resp_send(req, NULL, 0);
+			}
+		}
+		else{
+			/* bad request: the credentials are missing or not in the correct format */
+			memset(body.request.password, 0x00, sizeof(body.request.password));
+			httpd_resp_set_status(req, http_400_hdr);
 			httpd_resp_send(req, NULL, 0);
+		}
+
+	}
+	/* POST /power.json?profile=<performance|balanced|low-power> */
+	else if(http_app_path_equals(req->uri, http_power_url)){
 
+		char query[64];
+		char name[16];
+		wifi_manager_power_profile_t profile;
+
+		if(httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+			httpd_query_key_value(query, "profile", name, sizeof(name)) == ESP_OK &&
+			wifi_manager_get_power_profile_by_name(name, &profile)){
+
+			if(wifi_manager_set_power_profile_async(profile) == ESP_OK){
+				httpd_resp_set_status(req, http_200_hdr);
+				httpd_resp_set_type(req, http_content_type_json);
+				httpd_resp_set_hdr(req, http_cache_control_hdr, http_cache_control_no_cache);
+				httpd_resp_set_hdr(req, http_pragma_hdr, http_pragma_no_cache);
+				httpd_resp_send(req, NULL, 0);
+			}
+			else{
+				/* the wifi manager is busy: the client can try again shortly */
+				httpd_resp_set_status(req, http_503_hdr);
+				httpd_resp_set_hdr(req, http_retry_after_hdr, "1");
+				httpd_resp_send(req, NULL, 0);
+			}
 		}
 		else{
-			/* bad request the authentification header is not complete/not the correct format */
 			httpd_resp_set_status(req, http_400_hdr);
 			httpd_resp_send(req, NULL, 0);
 		}
-
 	}
 	else{
 
@@ -211,40 +1192,39 @@ static esp_err_t http_server_post_handler(httpd_req_t *req){
 
 static esp_err_t http_server_get_handler(httpd_req_t *req){
 
-    char* host = NULL;
-    size_t buf_len;
     esp_err_t ret = ESP_OK;
 
     ESP_LOGD(TAG, "GET %s", req->uri);
 
-    /* Get header value string length and allocate memory for length + 1,
-     * extra byte for null termination */
-    buf_len = httpd_req_get_hdr_value_len(req, "Host") + 1;
-    if (buf_len > 1) {
-    	host = malloc(buf_len);
-    	if(httpd_req_get_hdr_value_str(req, "Host", host, buf_len) != ESP_OK){
-    		/* if something is wrong we just 0 the whole memory */
-    		memset(host, 0x00, buf_len);
-    	}
-    }
-
-	/* determine if Host is from the STA IP address */
-	wifi_manager_lock_sta_ip_string(portMAX_DELAY);
-	bool access_from_sta_ip = host != NULL?strstr(host, wifi_manager_get_sta_ip_string()):false;
-	wifi_manager_unlock_sta_ip_string();
+    /* the httpd task handle is not exposed by esp_http_server: its stack is sampled while serving requests */
+    diag_sample_task(DIAG_TASK_HTTPD);
+    http_app_touch_session(req);
 
+    if(http_app_reject(req)){
+    	return ESP_OK;
+    }
 
-	if (host != NULL && !strstr(host, DEFAULT_AP_IP) && !access_from_sta_ip) {
-
-		/* Captive Portal functionality */
-		/* 302 Redirect to IP of the access point */
-		httpd_resp_set_status(req, http_302_hdr);
-		httpd_resp_set_hdr(req, http_location_hdr, http_redirect_url);
-		httpd_resp_send(req, NULL, 0);
-
+	/* captive portal: connectivity checks and requests to any other host get the precomputed 302 to the access point */
+	if (http_app_captive_portal && (http_app_is_probe(req->uri) || !http_app_host_is_local(req))) {
+		http_app_send_raw(req, http_redirect_response, http_redirect_response_len);
 	}
 	else{
 
+#ifdef HTTP_APP_PRECOMPUTED_RESPONSES
+		/* web app files: headers were generated at build time, the whole response is a single write */
+		/* GET /  */
+		if(strcmp(req->uri, http_root_url) == 0){
+			http_app_send_raw(req, http_app_index_html_response, http_app_index_html_response_len);
+		}
+		/* GET /code.js */
+		else if(strcmp(req->uri, http_js_url) == 0){
+			http_app_send_raw(req, http_app_code_js_response, http_app_code_js_response_len);
+		}
+		/* GET /style.css */
+		else if(strcmp(req->uri, http_css_url) == 0){
+			http_app_send_raw(req, http_app_style_css_response, http_app_style_css_response_len);
+		}
+#else
 		/* GET /  */
 		if(strcmp(req->uri, http_root_url) == 0){
 			httpd_resp_set_status(req, http_200_hdr);
@@ -264,19 +1244,41 @@ static esp_err_t http_server_get_handler(httpd_req_t *req){
 			httpd_resp_set_hdr(req, http_cache_control_hdr, http_cache_control_cache);
 			httpd_resp_send(req, (char*)style_css_start, style_css_end - style_css_start);
 		}
+#endif
 		/* GET /ap.json */
-		else if(strcmp(req->uri, http_ap_url) == 0){
+		else if(http_app_path_equals(req->uri, http_ap_url)){
+
+			/* ?since=N asks for what changed after generation N */
+			uint32_t since = 0;
+			bool delta = http_app_get_query_uint(req, "since", &since);
 
 			/* if we can get the mutex, write the last version of the AP list */
 			if(wifi_manager_lock_json_buffer(( TickType_t ) 10)){
 
-				httpd_resp_set_status(req, http_200_hdr);
-				httpd_resp_set_type(req, http_content_type_json);
-				httpd_resp_set_hdr(req, http_cache_control_hdr, http_cache_control_no_cache);
-				httpd_resp_set_hdr(req, http_pragma_hdr, http_pragma_no_cache);
-				char* ap_buf = wifi_manager_get_ap_list_json();
-				httpd_resp_send(req, ap_buf, strlen(ap_buf));
+				/* the list is rendered under the mutex and sent once it is released: a slow client cannot hold up the wifi manager */
+				bool not_modified = delta && since == wifi_manager_get_ap_list_generation();
+				char *list = NULL;
+				size_t len = 0;
+
+				if(!not_modified){
+					http_app_ap_list_since = since;
+					list = http_app_render_json(delta ? http_app_get_ap_list_delta_json : wifi_manager_get_ap_list_json, &len);
+				}
 				wifi_manager_unlock_json_buffer();
+
+				if(not_modified){
+					httpd_resp_set_status(req, http_304_hdr);
+					httpd_resp_set_hdr(req, http_cache_control_hdr, http_cache_control_no_cache);
+					httpd_resp_set_hdr(req, http_pragma_hdr, http_pragma_no_cache);
+					httpd_resp_send(req, NULL, 0);
+				}
+				else if(list){
+					http_app_send_rendered(req, http_content_type_json, list, len);
+				}
+				else{
+					httpd_resp_set_status(req, http_503_hdr);
+					httpd_resp_send(req, NULL, 0);
+				}
 			}
 			else{
 				httpd_resp_set_status(req, http_503_hdr);
@@ -287,10 +1289,44 @@ static esp_err_t http_server_get_handler(httpd_req_t *req){
 			/* request a wifi scan */
 			wifi_manager_scan_async();
 		}
-		/* GET /status.json */
-		else if(strcmp(req->uri, http_status_url) == 0){
+		/* GET /ap.bin */
+		else if(strcmp(req->uri, http_ap_bin_url) == 0){
 
 			if(wifi_manager_lock_json_buffer(( TickType_t ) 10)){
+
+				/* copied under the mutex, sent once it is released */
+				size_t len = 0;
+				uint8_t *list = http_app_render_ap_list_bin(&len);
+				wifi_manager_unlock_json_buffer();
+
+				if(list){
+					http_app_send_rendered(req, http_content_type_binary, (char*)list, len);
+				}
+				else{
+					httpd_resp_set_status(req, http_503_hdr);
+					httpd_resp_send(req, NULL, 0);
+				}
+			}
+			else{
+				httpd_resp_set_status(req, http_503_hdr);
+				httpd_resp_send(req, NULL, 0);
+				ESP_LOGE(TAG, "http_server_netconn_serve: GET /ap.bin failed to obtain mutex");
+			}
+
+			/* request a wifi scan */
+			wifi_manager_scan_async();
+		}
+		/* GET /status.json */
+		else if(http_app_path_equals(req->uri, http_status_url)){
+
+			/* long poll: ?wait=<ms>&version=<n> holds the response until the status moves past version n */
+			uint32_t wait_ms, version;
+			if(http_app_get_query_uint(req, "wait", &wait_ms) && wait_ms > 0 &&
+				http_app_get_query_uint(req, "version", &version) &&
+				http_app_park_status_request(req, version, wait_ms)){
+				/* response is sent by http_app_release_status_waiters */
+			}
+			else if(wifi_manager_lock_json_buffer(( TickType_t ) 10)){
 				char *buff = wifi_manager_get_ip_info_json();
 				if(buff){
 					httpd_resp_set_status(req, http_200_hdr);
@@ -311,6 +1347,32 @@ static esp_err_t http_server_get_handler(httpd_req_t *req){
 				ESP_LOGE(TAG, "http_server_netconn_serve: GET /status.json failed to obtain mutex");
 			}
 		}
+		/* GET /diag.json and GET /latency.json */
+		else if(strcmp(req->uri, http_diag_url) == 0 || strcmp(req->uri, http_latency_url) == 0){
+			http_app_send_json(req, strcmp(req->uri, http_diag_url) == 0 ? diag_get_memory_json : diag_get_latency_json);
+		}
+		/* GET /connect.json?id=N: outcome of a connection request */
+		else if(http_app_path_equals(req->uri, http_connect_url)){
+			if(http_app_get_query_uint(req, "id", &http_app_connect_id)){
+				http_app_send_json(req, http_app_get_connect_json);
+			}
+			else{
+				httpd_resp_set_status(req, http_400_hdr);
+				httpd_resp_send(req, NULL, 0);
+			}
+		}
+		/* GET /power.json */
+		else if(strcmp(req->uri, http_power_url) == 0){
+			http_app_send_json(req, wifi_manager_get_power_json);
+		}
+		/* GET /settings.json */
+		else if(strcmp(req->uri, http_settings_url) == 0){
+			http_app_send_json(req, wifi_manager_get_settings_json);
+		}
+		/* GET /events.json */
+		else if(strcmp(req->uri, http_events_url) == 0){
+			http_app_send_json(req, wifi_manager_get_subscribers_json);
+		}
 		else{
 
 			if(custom_get_httpd_uri_handler == NULL){
@@ -326,11 +1388,6 @@ static esp_err_t http_server_get_handler(httpd_req_t *req){
 
 	}
 
-    /* memory clean up */
-    if(host != NULL){
-    	free(host);
-    }
-
     return ret;
 
 }
@@ -354,6 +1411,12 @@ static const httpd_uri_t http_server_delete_request = {
 	.handler = http_server_delete_handler
 };
 
+static const httpd_uri_t http_server_patch_request = {
+	.uri	= "*",
+	.method = HTTP_PATCH,
+	.handler = http_server_patch_handler
+};
+
 
 void http_app_stop(){
 
@@ -362,36 +1425,65 @@ void http_app_stop(){
 
 		/* dealloc URLs */
 		if(http_root_url) {
-			free(http_root_url);
+			diag_free(DIAG_HEAP_HTTP_APP, http_root_url);
 			http_root_url = NULL;
 		}
-		if(http_redirect_url){
-			free(http_redirect_url);
-			http_redirect_url = NULL;
+		if(http_redirect_response){
+			diag_free(DIAG_HEAP_HTTP_APP, http_redirect_response);
+			http_redirect_response = NULL;
 		}
 		if(http_js_url){
-			free(http_js_url);
+			diag_free(DIAG_HEAP_HTTP_APP, http_js_url);
 			http_js_url = NULL;
 		}
 		if(http_css_url){
-			free(http_css_url);
+			diag_free(DIAG_HEAP_HTTP_APP, http_css_url);
 			http_css_url = NULL;
 		}
 		if(http_connect_url){
-			free(http_connect_url);
+			diag_free(DIAG_HEAP_HTTP_APP, http_connect_url);
 			http_connect_url = NULL;
 		}
 		if(http_ap_url){
-			free(http_ap_url);
+			diag_free(DIAG_HEAP_HTTP_APP, http_ap_url);
 			http_ap_url = NULL;
 		}
+		if(http_ap_bin_url){
+			diag_free(DIAG_HEAP_HTTP_APP, http_ap_bin_url);
+			http_ap_bin_url = NULL;
+		}
 		if(http_status_url){
-			free(http_status_url);
+			diag_free(DIAG_HEAP_HTTP_APP, http_status_url);
 			http_status_url = NULL;
 		}
+		if(http_diag_url){
+			diag_free(DIAG_HEAP_HTTP_APP, http_diag_url);
+			http_diag_url = NULL;
+		}
+		if(http_latency_url){
+			diag_free(DIAG_HEAP_HTTP_APP, http_latency_url);
+			http_latency_url = NULL;
+		}
+		if(http_power_url){
+			diag_free(DIAG_HEAP_HTTP_APP, http_power_url);
+			http_power_url = NULL;
+		}
+		if(http_settings_url){
+			diag_free(DIAG_HEAP_HTTP_APP, http_settings_url);
+			http_settings_url = NULL;
+		}
+		if(http_events_url){
+			diag_free(DIAG_HEAP_HTTP_APP, http_events_url);
+			http_events_url = NULL;
+		}
 
-		/* stop server */
+		/* stop server: waiting /status.json requests are closed with their socket */
+		if(http_app_status_timer){
+			xTimerDelete(http_app_status_timer, portMAX_DELAY);
+			http_app_status_timer = NULL;
+		}
 		httpd_stop(httpd_handle);
+		diag_unregister_task(DIAG_TASK_HTTPD);
 		httpd_handle = NULL;
 	}
 }
@@ -407,7 +1499,7 @@ static char* http_app_generate_url(const char* page){
 	int root_len = strlen(WEBAPP_LOCATION);
 	const size_t url_sz = sizeof(char) * ( (root_len+1) + ( strlen(page) + 1) );
 
-	ret = malloc(url_sz);
+	ret = diag_malloc(DIAG_HEAP_HTTP_APP, url_sz);
 	memset(ret, 0x00, url_sz);
 	strcpy(ret, WEBAPP_LOCATION);
 	ret = strcat(ret, page);
@@ -415,10 +1507,30 @@ static char* http_app_generate_url(const char* page){
 	return ret;
 }
 
+void http_app_set_lru_purge(bool lru_purge_enable){
+	if(http_app_lru_purge != lru_purge_enable){
+		ESP_LOGI(TAG, "Socket purge policy set to %s", lru_purge_enable?"LRU":"none");
+		http_app_lru_purge = lru_purge_enable;
+	}
+}
+
+void http_app_set_captive_portal(bool enable){
+	if(http_app_captive_portal != enable){
+		ESP_LOGI(TAG, "Captive portal %s", enable?"enabled":"disabled");
+		http_app_captive_portal = enable;
+	}
+}
+
+bool http_app_is_running(){
+	return httpd_handle != NULL;
+}
+
 void http_app_start(bool lru_purge_enable){
 
 	esp_err_t err;
 
+	http_app_set_lru_purge(lru_purge_enable);
+
 	if(httpd_handle == NULL){
 
 		httpd_config_t config = HTTPD_DEFAULT_CONFIG();
@@ -426,7 +1538,20 @@ void http_app_start(bool lru_purge_enable){
 		/* this is an important option that isn't set up by default.
 		 * We could register all URLs one by one, but this would not work while the fake DNS is active */
 		config.uri_match_fn = httpd_uri_match_wildcard;
-		config.lru_purge_enable = lru_purge_enable;
+
+		/* purge is handled by http_app_open_fn so that it can be switched on and off without a restart */
+		config.lru_purge_enable = false;
+		config.max_open_sockets = HTTP_APP_MAX_OPEN_SOCKETS;
+		config.open_fn = http_app_open_fn;
+		config.close_fn = http_app_close_fn;
+		for(int i=0; i<HTTP_APP_MAX_OPEN_SOCKETS; i++){
+			http_app_sessions[i].fd = -1;
+			http_app_status_waiters[i].fd = -1;
+		}
+		memset(http_app_clients, 0x00, sizeof(http_app_clients));
+		if(http_app_status_timer == NULL){
+			http_app_status_timer = xTimerCreate( NULL, pdMS_TO_TICKS(1000), pdFALSE, ( void * ) 0, http_app_status_timer_cb);
+		}
 
 		/* generate the URLs */
 		if(http_root_url == NULL){
@@ -437,42 +1562,56 @@ void http_app_start(bool lru_purge_enable){
 			const char page_css[] = "style.css";
 			const char page_connect[] = "connect.json";
 			const char page_ap[] = "ap.json";
+			const char page_ap_bin[] = "ap.bin";
 			const char page_status[] = "status.json";
+			const char page_diag[] = "diag.json";
+			const char page_latency[] = "latency.json";
+			const char page_power[] = "power.json";
+			const char page_settings[] = "settings.json";
+			const char page_events[] = "events.json";
 
 			/* root url, eg "/"   */
 			const size_t http_root_url_sz = sizeof(char) * (root_len+1);
-			http_root_url = malloc(http_root_url_sz);
+			http_root_url = diag_malloc(DIAG_HEAP_HTTP_APP, http_root_url_sz);
 			memset(http_root_url, 0x00, http_root_url_sz);
 			strcpy(http_root_url, WEBAPP_LOCATION);
 
-			/* redirect url */
-			size_t redirect_sz = 22 + root_len + 1; /* strlen(http://255.255.255.255) + strlen("/") + 1 for \0 */
-			http_redirect_url = malloc(sizeof(char) * redirect_sz);
-			*http_redirect_url = '\0';
+			/* complete redirect response, sent as is to every request caught by the captive portal */
+			const char redirect_fmt[] = "HTTP/1.1 %s\r\n%s: http://%s%s\r\nCache-Control: no-store\r\nContent-Length: 0\r\n\r\n";
+			size_t redirect_sz = sizeof(redirect_fmt) + sizeof(http_302_hdr) + sizeof(http_location_hdr) + 15 + root_len; /* 15: strlen(255.255.255.255) */
+			http_redirect_response = diag_malloc(DIAG_HEAP_HTTP_APP, sizeof(char) * redirect_sz);
+			http_redirect_response_len = snprintf(http_redirect_response, redirect_sz, redirect_fmt,
+					http_302_hdr,
+					http_location_hdr,
+					DEFAULT_AP_IP,
+					root_len == 1 ? "" : WEBAPP_LOCATION);
 
-			if(root_len == 1){
-				snprintf(http_redirect_url, redirect_sz, "http://%s", DEFAULT_AP_IP);
-			}
-			else{
-				snprintf(http_redirect_url, redirect_sz, "http://%s%s", DEFAULT_AP_IP, WEBAPP_LOCATION);
-			}
+			inet_pton(AF_INET, DEFAULT_AP_IP, &http_app_ap_ip);
 
 			/* generate the other pages URLs*/
 			http_js_url = http_app_generate_url(page_js);
 			http_css_url = http_app_generate_url(page_css);
 			http_connect_url = http_app_generate_url(page_connect);
 			http_ap_url = http_app_generate_url(page_ap);
+			http_ap_bin_url = http_app_generate_url(page_ap_bin);
 			http_status_url = http_app_generate_url(page_status);
+			http_diag_url = http_app_generate_url(page_diag);
+			http_latency_url = http_app_generate_url(page_latency);
+			http_power_url = http_app_generate_url(page_power);
+			http_settings_url = http_app_generate_url(page_settings);
+			http_events_url = http_app_generate_url(page_events);
 
 		}
 
 		err = httpd_start(&httpd_handle, &config);
+		diag_register_task(DIAG_TASK_HTTPD, NULL, config.stack_size);
 
 	    if (err == ESP_OK) {
 	        ESP_LOGI(TAG, "Registering URI handlers");
 	        httpd_register_uri_handler(httpd_handle, &http_server_get_request);
 	        httpd_register_uri_handler(httpd_handle, &http_server_post_request);
 	        httpd_register_uri_handler(httpd_handle, &http_server_delete_request);
+	        httpd_register_uri_handler(httpd_handle, &http_server_patch_request);
 	    }
 	}
 
@@ -48,12 +48,74 @@ extern "C" {
  */
 #define WEBAPP_LOCATION 					CONFIG_WEBAPP_LOCATION
 
+/** @brief Defines the maximum number of sockets the http server keeps open at the same time. */
+#define HTTP_APP_MAX_OPEN_SOCKETS			7
+
+/** @brief Defines the requests per second allowed per client IP. 0 disables the rate limit. */
+#define HTTP_APP_RATE_LIMIT					CONFIG_WIFI_MANAGER_HTTP_RATE_LIMIT
+
+/** @brief Defines the burst of requests allowed per client IP before the rate limit applies. */
+#define HTTP_APP_RATE_BURST					CONFIG_WIFI_MANAGER_HTTP_RATE_BURST
+
+/**
+ * @brief Defines how many client IPs are rate limited at the same time.
+ * When the table is full the client that was seen the longest time ago is forgotten.
+ */
+#define HTTP_APP_RATE_LIMIT_CLIENTS			8
+
+/**
+ * @brief Defines the maximum time in ms a /status.json?wait=<ms>&version=<n> request is held waiting for a change of status.
+ */
+#define HTTP_APP_STATUS_MAX_WAIT_MS			30000
+
+/**
+ * @brief Defines the size in bytes of the stack buffer used to stream JSON and binary responses.
+ * Responses are sent as chunks of at most this size, whatever the size of the document.
+ */
+#define HTTP_APP_CHUNK_SIZE				256
+
+/**
+ * @brief Defines the largest request body accepted, in bytes. Bodies are parsed as they are received, a few bytes at a time:
+ * this is not the size of a buffer.
+ */
+#define HTTP_APP_MAX_BODY_SIZE			512
+
 
 /** 
  * @brief spawns the http server 
+ * @note if the server is already running, its socket purge policy is updated in place.
  */
 void http_app_start(bool lru_purge_enable);
 
+/**
+ * @brief changes the socket purge policy of a running http server without restarting it.
+ *
+ * When enabled, the least recently used session is closed as soon as all sockets are in use so that a new
+ * client can always be accepted. This is what you want when serving the captive portal where phones open
+ * a lot of connections, and what you do not want when long lived connections must be kept.
+ */
+void http_app_set_lru_purge(bool lru_purge_enable);
+
+/**
+ * @brief enables or disables the captive portal behavior of a running http server.
+ *
+ * When enabled, any request made to a host that is neither the access point, the STA IP address nor the mDNS hostname is redirected
+ * to the wifi manager. This is only useful while the access point is up: once in STA mode the device can be reached
+ * under other names (mDNS hostname for instance) and these requests must be served, not redirected.
+ */
+void http_app_set_captive_portal(bool enable);
+
+/**
+ * @brief returns true if the http server is running.
+ */
+bool http_app_is_running();
+
+/**
+ * @brief wakes up the /status.json requests waiting for a change of status.
+ * Called by the wifi_manager every time the connection status json is regenerated. Safe to call from any task.
+ */
+void http_app_notify_status_changed();
+
 /**
  * @brief stops the http server 
  */
@@ -29,115 +29,676 @@ OTHER DEALINGS IN THE SOFTWARE.
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include "json.h"
 
 
+/**
+ * @brief escape character for each byte value: 0 means the byte is copied as is, 'u' means it is printed as a \u00XX sequence.
+ * This replaces the strchr on the set of characters to escape that was done for every byte.
+ */
+static const unsigned char json_escape_table[256] = {
+	/* 0x00 - 0x1f: control characters */
+	'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+	'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+	/* 0x20 - 0x2f: '"' */
+	0, 0, '\"', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	/* 0x50 - 0x5f: '\\' */
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '\\', 0, 0, 0
+	/* 0x60 - 0xff: everything else, UTF-8 included, is copied as is */
+};
+
+static const char json_hex_digits[] = "0123456789abcdef";
+
+
+/**
+ * @brief tells if a word of 4 characters can be copied as is, i.e. it contains no control character, no null
+ * terminator, no '"' and no '\\'. Each test is the classic "has a byte less than n / equal to zero" bit trick so
+ * the 4 bytes are checked at once without any branch.
+ */
+static inline bool json_word_is_clean(uint32_t w){
+	uint32_t quote = w ^ 0x22222222UL;
+	uint32_t backslash = w ^ 0x5c5c5c5cUL;
+
+	uint32_t control = (w - 0x20202020UL) & ~w;
+	quote = (quote - 0x01010101UL) & ~quote;
+	backslash = (backslash - 0x01010101UL) & ~backslash;
+
+	return ((control | quote | backslash) & 0x80808080UL) == 0;
+}
+
+
+/**
+ * @brief escapes input into the output buffer, stopping at input_end or when output_end is reached.
+ * An escape sequence is never cut: it is written whole or not at all.
+ * @param output pointer to the output position, advanced by the number of bytes written.
+ * @return pointer to the first character of input not consumed. It is input_end when the whole input was escaped.
+ */
+static const unsigned char* json_escape(const unsigned char *input_pointer, const unsigned char *input_end, unsigned char **output, const unsigned char *output_end)
+{
+	unsigned char *output_pointer = *output;
+	unsigned char c, escape;
+
+	while (input_pointer < input_end)
+	{
+		/* copy in bulk as long as words are aligned and clean. A word is only read when its 4 bytes are
+		 * part of the input: the null terminator and what follows it are never touched */
+		if (((uintptr_t)input_pointer & 3) == 0)
+		{
+			while (input_end - input_pointer >= 4 && output_end - output_pointer >= 4)
+			{
+				uint32_t word;
+				memcpy(&word, __builtin_assume_aligned(input_pointer, 4), sizeof(word));
+				if (!json_word_is_clean(word))
+				{
+					break;
+				}
+				memcpy(output_pointer, input_pointer, sizeof(word));
+				input_pointer += sizeof(word);
+				output_pointer += sizeof(word);
+			}
+		}
+
+		if (input_pointer == input_end)
+		{
+			break;
+		}
+
+		c = *input_pointer;
+		escape = json_escape_table[c];
+		if (escape == 0)
+		{
+			/* normal character, copy */
+			if (output_pointer >= output_end)
+			{
+				break;
+			}
+			*output_pointer++ = c;
+		}
+		else if (escape != 'u')
+		{
+			/* one character escape sequence */
+			if (output_end - output_pointer < 2)
+			{
+				break;
+			}
+			*output_pointer++ = '\\';
+			*output_pointer++ = escape;
+		}
+		else
+		{
+			/* escape and print as unicode codepoint */
+			if (output_end - output_pointer < 6)
+			{
+				break;
+			}
+			*output_pointer++ = '\\';
+			*output_pointer++ = 'u';
+			*output_pointer++ = '0';
+			*output_pointer++ = '0';
+			*output_pointer++ = json_hex_digits[c >> 4];
+			*output_pointer++ = json_hex_digits[c & 0x0f];
+		}
+		input_pointer++;
+	}
+
+	*output = output_pointer;
+	return input_pointer;
+}
+
+
+size_t json_print_string_len(const unsigned char *input, unsigned char *output_buffer, size_t output_size)
+{
+	unsigned char *output_pointer = output_buffer;
+
+	/* room for at least the two quotes and the null terminator */
+	if (output_buffer == NULL || output_size < 3)
+	{
+		return 0;
+	}
+
+	*output_pointer++ = '\"';
+
+	/* NULL input is printed as an empty string. The closing quote and the null terminator are always kept free */
+	if (input != NULL)
+	{
+		const unsigned char *input_end = input + strlen((const char*)input);
+		if (json_escape(input, input_end, &output_pointer, output_buffer + output_size - 2) != input_end)
+		{
+			return 0;
+		}
+	}
+
+	*output_pointer++ = '\"';
+	*output_pointer = '\0';
+
+	return (size_t)(output_pointer - output_buffer);
+}
+
+
 bool json_print_string(const unsigned char *input, unsigned char *output_buffer)
 {
-	const unsigned char *input_pointer = NULL;
-	unsigned char *output = NULL;
-	unsigned char *output_pointer = NULL;
-	size_t output_length = 0;
-	/* numbers of additional characters needed for escaping */
-	size_t escape_characters = 0;
+	/* legacy behavior: the caller guarantees the buffer is big enough for the worst case, every character printed as \u00XX */
+	size_t input_length = input != NULL ? strlen((const char*)input) : 0;
+	return json_print_string_len(input, output_buffer, input_length * 6 + 3) != 0;
+}
+
+
+void json_writer_init(json_writer_t *writer, char *buffer, size_t size, json_writer_flush_t flush, void *ctx)
+{
+	memset(writer, 0x00, sizeof(json_writer_t));
+	writer->buffer = buffer;
+	writer->size = size;
+	writer->flush = flush;
+	writer->flush_ctx = ctx;
+
+	/* a buffer too small for even the null terminator is an error from the start */
+	if (buffer == NULL || size < 2)
+	{
+		writer->error = true;
+	}
+	else
+	{
+		buffer[0] = '\0';
+	}
+}
 
-	if (output_buffer == NULL)
+
+/**
+ * @brief hands over the content of the buffer to the flush callback and empties it.
+ * @return false if there is no flush callback or if it failed.
+ */
+static bool json_writer_flush(json_writer_t *writer)
+{
+	if (writer->flush == NULL || !writer->flush(writer->flush_ctx, writer->buffer, writer->len))
 	{
+		writer->error = true;
 		return false;
 	}
 
-	/* empty string */
-	if (input == NULL)
+	writer->len = 0;
+	writer->buffer[0] = '\0';
+	return true;
+}
+
+
+/**
+ * @brief appends raw characters, flushing as many times as needed.
+ */
+static bool json_writer_put(json_writer_t *writer, const char *str, size_t len)
+{
+	while (!writer->error && len > 0)
 	{
-		//output = ensure(output_buffer, sizeof("\"\""), hooks);
-		if (output == NULL)
+		/* one byte is always kept for the null terminator */
+		size_t room = writer->size - 1 - writer->len;
+		if (room == 0)
 		{
-			return false;
+			json_writer_flush(writer);
+			continue;
 		}
-		strcpy((char*)output, "\"\"");
 
-		return true;
+		size_t n = len < room ? len : room;
+		memcpy(writer->buffer + writer->len, str, n);
+		writer->len += n;
+		writer->total += n;
+		writer->buffer[writer->len] = '\0';
+		str += n;
+		len -= n;
+	}
+
+	return !writer->error;
+}
+
+
+/**
+ * @brief prints the separator expected before a new value or key in the current container.
+ */
+static bool json_writer_separator(json_writer_t *writer)
+{
+	if (writer->after_key)
+	{
+		/* value of a key: the colon was already printed */
+		writer->after_key = false;
+		return !writer->error;
 	}
 
-	/* set "flag" to 1 if something needs to be escaped */
-	for (input_pointer = input; *input_pointer; input_pointer++)
+	if (writer->depth > 0)
 	{
-		if (strchr("\"\\\b\f\n\r\t", *input_pointer))
+		uint32_t bit = 1UL << (writer->depth - 1);
+		if (writer->not_first & bit)
 		{
-			/* one character escape sequence */
-			escape_characters++;
+			return json_writer_put(writer, ",", 1);
 		}
-		else if (*input_pointer < 32)
+		writer->not_first |= bit;
+	}
+
+	return !writer->error;
+}
+
+
+static bool json_writer_begin(json_writer_t *writer, char c)
+{
+	if (writer->depth >= JSON_WRITER_MAX_DEPTH)
+	{
+		writer->error = true;
+		return false;
+	}
+
+	if (json_writer_separator(writer) && json_writer_put(writer, &c, 1))
+	{
+		writer->depth++;
+		writer->not_first &= ~(1UL << (writer->depth - 1));
+	}
+
+	return !writer->error;
+}
+
+
+static bool json_writer_end(json_writer_t *writer, char c)
+{
+	if (writer->depth == 0 || writer->after_key)
+	{
+		writer->error = true;
+		return false;
+	}
+
+	writer->depth--;
+	return json_writer_put(writer, &c, 1);
+}
+
+
+bool json_writer_begin_object(json_writer_t *writer)
+{
+	return json_writer_begin(writer, '{');
+}
+
+bool json_writer_end_object(json_writer_t *writer)
+{
+	return json_writer_end(writer, '}');
+}
+
+bool json_writer_begin_array(json_writer_t *writer)
+{
+	return json_writer_begin(writer, '[');
+}
+
+bool json_writer_end_array(json_writer_t *writer)
+{
+	return json_writer_end(writer, ']');
+}
+
+
+bool json_writer_key(json_writer_t *writer, const char *key)
+{
+	if (writer->after_key || !json_writer_string(writer, key))
+	{
+		writer->error = true;
+		return false;
+	}
+
+	writer->after_key = true;
+	return json_writer_put(writer, ":", 1);
+}
+
+
+bool json_writer_string(json_writer_t *writer, const char *str)
+{
+	const unsigned char *input_pointer = (const unsigned char*)str;
+	const unsigned char *input_end = input_pointer != NULL ? input_pointer + strlen(str) : NULL;
+
+	if (!json_writer_separator(writer) || !json_writer_put(writer, "\"", 1))
+	{
+		return false;
+	}
+
+	/* NULL is printed as an empty string */
+	while (input_pointer != input_end)
+	{
+		unsigned char *output_pointer = (unsigned char*)writer->buffer + writer->len;
+		const unsigned char *output_end = (const unsigned char*)writer->buffer + writer->size - 1;
+
+		input_pointer = json_escape(input_pointer, input_end, &output_pointer, output_end);
+
+		size_t n = (size_t)(output_pointer - ((unsigned char*)writer->buffer + writer->len));
+		writer->len += n;
+		writer->total += n;
+		writer->buffer[writer->len] = '\0';
+
+		if (input_pointer != input_end)
 		{
-			/* UTF-16 escape sequence uXXXX */
-			escape_characters += 5;
+			/* the buffer is full: flush and continue where the escaper stopped. An empty buffer that cannot
+			 * hold a single escape sequence would never make progress */
+			if (writer->len == 0)
+			{
+				writer->error = true;
+			}
+			if (writer->error || !json_writer_flush(writer))
+			{
+				return false;
+			}
 		}
 	}
-	output_length = (size_t)(input_pointer - input) + escape_characters;
 
-	/* in the original cJSON it is possible to realloc here in case output buffer is too small.
-	 * This is overkill for an embedded system. */
-	output = output_buffer;
+	return json_writer_put(writer, "\"", 1);
+}
+
+
+bool json_writer_int(json_writer_t *writer, int32_t value)
+{
+	char str[12]; /* "-2147483648" */
+	int n = snprintf(str, sizeof(str), "%d", (int)value);
+
+	return json_writer_separator(writer) && json_writer_put(writer, str, (size_t)n);
+}
+
+
+bool json_writer_bool(json_writer_t *writer, bool value)
+{
+	return json_writer_separator(writer) && (value ? json_writer_put(writer, "true", 4) : json_writer_put(writer, "false", 5));
+}
+
 
-	/* no characters have to be escaped */
-	if (escape_characters == 0)
+bool json_writer_finish(json_writer_t *writer)
+{
+	if (writer->depth != 0 || writer->after_key)
 	{
-		output[0] = '\"';
-		memcpy(output + 1, input, output_length);
-		output[output_length + 1] = '\"';
-		output[output_length + 2] = '\0';
+		writer->error = true;
+	}
 
-		return true;
+	/* whatever remains is handed over to the flush callback, if any */
+	if (!writer->error && writer->flush != NULL && writer->len > 0)
+	{
+		json_writer_flush(writer);
 	}
 
-	output[0] = '\"';
-	output_pointer = output + 1;
-	/* copy the string */
-	for (input_pointer = input; *input_pointer != '\0'; (void)input_pointer++, output_pointer++)
+	return !writer->error;
+}
+
+
+/* states of json_reader_t */
+enum
+{
+	JSON_READER_BEGIN = 0,		/* before '{' */
+	JSON_READER_FIRST_KEY,		/* after '{': a key or '}' */
+	JSON_READER_NEXT_KEY,		/* after ',': a key */
+	JSON_READER_KEY,			/* inside a key */
+	JSON_READER_COLON,			/* after a key */
+	JSON_READER_VALUE,			/* after ':' */
+	JSON_READER_STRING,			/* inside a string value */
+	JSON_READER_LITERAL,		/* inside a number, true, false or null */
+	JSON_READER_NEXT,			/* after a value: ',' or '}' */
+	JSON_READER_END				/* after '}': only whitespace */
+};
+
+
+void json_reader_init(json_reader_t *reader, json_reader_member_t member, void *ctx)
+{
+	memset(reader, 0x00, sizeof(json_reader_t));
+	reader->member = member;
+	reader->ctx = ctx;
+	reader->state = JSON_READER_BEGIN;
+}
+
+
+static inline bool json_reader_is_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+
+/**
+ * @brief appends a byte to the key or the value being read.
+ */
+static bool json_reader_append(json_reader_t *reader, char c)
+{
+	if (reader->state == JSON_READER_KEY)
 	{
-		if ((*input_pointer > 31) && (*input_pointer != '\"') && (*input_pointer != '\\'))
+		if (reader->key_len >= JSON_READER_KEY_SIZE)
 		{
-			/* normal character, copy */
-			*output_pointer = *input_pointer;
+			return false;
 		}
-		else
+		reader->key[reader->key_len++] = c;
+	}
+	else
+	{
+		if (reader->value_len >= JSON_READER_VALUE_SIZE)
 		{
-			/* character needs to be escaped */
-			*output_pointer++ = '\\';
-			switch (*input_pointer)
-			{
+			return false;
+		}
+		reader->value[reader->value_len++] = c;
+	}
+
+	return true;
+}
+
+
+/**
+ * @brief appends a code point of a \uXXXX sequence as UTF-8. Surrogate pairs are not combined.
+ */
+static bool json_reader_append_unicode(json_reader_t *reader, uint16_t u)
+{
+	if (u == 0)
+	{
+		/* would cut the string short */
+		return false;
+	}
+	if (u < 0x80)
+	{
+		return json_reader_append(reader, (char)u);
+	}
+	if (u < 0x800)
+	{
+		return json_reader_append(reader, (char)(0xc0 | (u >> 6))) &&
+			json_reader_append(reader, (char)(0x80 | (u & 0x3f)));
+	}
+	return json_reader_append(reader, (char)(0xe0 | (u >> 12))) &&
+		json_reader_append(reader, (char)(0x80 | ((u >> 6) & 0x3f))) &&
+		json_reader_append(reader, (char)(0x80 | (u & 0x3f)));
+}
+
+
+/**
+ * @brief reads one character of a key or a string value.
+ */
+static bool json_reader_string_char(json_reader_t *reader, char c)
+{
+	if (reader->unicode_digits > 0)
+	{
+		int digit;
+		if (c >= '0' && c <= '9') digit = c - '0';
+		else if (c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F') digit = c - 'A' + 10;
+		else return false;
+
+		reader->unicode = (uint16_t)((reader->unicode << 4) | digit);
+		if (--reader->unicode_digits == 0)
+		{
+			return json_reader_append_unicode(reader, reader->unicode);
+		}
+		return true;
+	}
+
+	if (reader->escape)
+	{
+		reader->escape = false;
+		switch (c)
+		{
+			case '"':
 			case '\\':
-				*output_pointer = '\\';
-				break;
-			case '\"':
-				*output_pointer = '\"';
-				break;
-			case '\b':
-				*output_pointer = 'b';
-				break;
-			case '\f':
-				*output_pointer = 'f';
-				break;
-			case '\n':
-				*output_pointer = 'n';
-				break;
-			case '\r':
-				*output_pointer = 'r';
-				break;
-			case '\t':
-				*output_pointer = 't';
-				break;
+			case '/':
+				return json_reader_append(reader, c);
+			case 'b':
+				return json_reader_append(reader, '\b');
+			case 'f':
+				return json_reader_append(reader, '\f');
+			case 'n':
+				return json_reader_append(reader, '\n');
+			case 'r':
+				return json_reader_append(reader, '\r');
+			case 't':
+				return json_reader_append(reader, '\t');
+			case 'u':
+				reader->unicode = 0;
+				reader->unicode_digits = 4;
+				return true;
 			default:
-				/* escape and print as unicode codepoint */
-				sprintf((char*)output_pointer, "u%04x", *input_pointer);
-				output_pointer += 4;
-				break;
+				return false;
+		}
+	}
+
+	if (c == '\\')
+	{
+		reader->escape = true;
+		return true;
+	}
+
+	if (c == '"')
+	{
+		if (reader->state == JSON_READER_KEY)
+		{
+			reader->key[reader->key_len] = '\0';
+			reader->state = JSON_READER_COLON;
+			return true;
+		}
+		reader->value[reader->value_len] = '\0';
+		reader->state = JSON_READER_NEXT;
+		return reader->member(reader->ctx, reader->key, reader->value, true);
+	}
+
+	/* control characters must be escaped */
+	if ((unsigned char)c < 0x20)
+	{
+		return false;
+	}
+
+	return json_reader_append(reader, c);
+}
+
+
+/**
+ * @brief hands over a number, true, false or null to the member callback.
+ */
+static bool json_reader_end_literal(json_reader_t *reader)
+{
+	const char *v = reader->value;
+
+	reader->value[reader->value_len] = '\0';
+	if (strcmp(v, "true") != 0 && strcmp(v, "false") != 0 && strcmp(v, "null") != 0)
+	{
+		char *end = NULL;
+		strtod(v, &end);
+		if (end == v || *end != '\0')
+		{
+			return false;
+		}
+	}
+
+	reader->state = JSON_READER_NEXT;
+	return reader->member(reader->ctx, reader->key, reader->value, false);
+}
+
+
+static bool json_reader_char(json_reader_t *reader, char c)
+{
+	switch (reader->state)
+	{
+		case JSON_READER_KEY:
+		case JSON_READER_STRING:
+			return json_reader_string_char(reader, c);
+
+		case JSON_READER_LITERAL:
+			if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '-' || c == '+' || c == '.')
+			{
+				return json_reader_append(reader, c);
 			}
+			/* the character that ends the literal belongs to what follows */
+			return json_reader_end_literal(reader) && json_reader_char(reader, c);
+
+		default:
+			break;
+	}
+
+	if (json_reader_is_space(c))
+	{
+		return true;
+	}
+
+	switch (reader->state)
+	{
+		case JSON_READER_BEGIN:
+			if (c != '{') return false;
+			reader->state = JSON_READER_FIRST_KEY;
+			return true;
+
+		case JSON_READER_FIRST_KEY:
+		case JSON_READER_NEXT_KEY:
+			if (c == '}' && reader->state == JSON_READER_FIRST_KEY)
+			{
+				reader->state = JSON_READER_END;
+				return true;
+			}
+			if (c != '"') return false;
+			reader->key_len = 0;
+			reader->state = JSON_READER_KEY;
+			return true;
+
+		case JSON_READER_COLON:
+			if (c != ':') return false;
+			reader->state = JSON_READER_VALUE;
+			return true;
+
+		case JSON_READER_VALUE:
+			reader->value_len = 0;
+			if (c == '"')
+			{
+				reader->state = JSON_READER_STRING;
+				return true;
+			}
+			/* nested objects and arrays are not supported */
+			if (c == '{' || c == '[' || c == ',' || c == '}')
+			{
+				return false;
+			}
+			reader->state = JSON_READER_LITERAL;
+			return json_reader_append(reader, c);
+
+		case JSON_READER_NEXT:
+			if (c == ',')
+			{
+				reader->state = JSON_READER_NEXT_KEY;
+				return true;
+			}
+			if (c == '}')
+			{
+				reader->state = JSON_READER_END;
+				return true;
+			}
+			return false;
+
+		default:
+			/* nothing can follow the end of the object */
+			return false;
+	}
+}
+
+
+bool json_reader_feed(json_reader_t *reader, const char *data, size_t len)
+{
+	for (size_t i = 0; i < len && !reader->error; i++)
+	{
+		if (!json_reader_char(reader, data[i]))
+		{
+			reader->error = true;
 		}
 	}
-	output[output_length + 1] = '\"';
-	output[output_length + 2] = '\0';
 
-	return true;
+	return !reader->error;
 }
 
+
+bool json_reader_finish(json_reader_t *reader)
+{
+	return !reader->error && reader->state == JSON_READER_END;
+}
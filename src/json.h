@@ -28,10 +28,67 @@ OTHER DEALINGS IN THE SOFTWARE.
 #ifndef JSON_H_INCLUDED
 #define JSON_H_INCLUDED
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/**
+ * @brief Worst case size in bytes of a string of len characters once escaped and quoted, null terminator excluded.
+ * This happens when every character is a control character printed as \u00XX.
+ */
+#define JSON_ESCAPED_STRING_MAX_SIZE(len)		(6 * (len) + 2)
+
+/**
+ * @brief Maximum nesting of objects and arrays supported by json_writer_t.
+ */
+#define JSON_WRITER_MAX_DEPTH					32
+
+/**
+ * @brief Function called by a json_writer_t when its buffer is full, and when the document is finished.
+ * @param ctx the context given to json_writer_init, typically a httpd_req_t.
+ * @return true if the data was consumed. Returning false aborts the document.
+ */
+typedef bool (*json_writer_flush_t)(void *ctx, const char *buf, size_t len);
+
+/**
+ * @brief Streaming JSON writer. Commas, colons and quotes are handled by the writer and the capacity of the buffer
+ * is checked on every write.
+ *
+ * Without a flush callback the document is built in the buffer, which stays null terminated, and any overflow is
+ * reported as an error. With a flush callback the buffer is only a staging area: it is handed over to the callback
+ * every time it is full so documents of any size can be produced with a small buffer.
+ *
+ * Errors are sticky: after the first failure every call returns false and json_writer_finish reports it.
+ */
+typedef struct{
+	char *buffer;
+	size_t size;				/* capacity of the buffer, null terminator included */
+	size_t len;					/* bytes currently in the buffer */
+	size_t total;				/* bytes produced since json_writer_init, flushed ones included */
+	json_writer_flush_t flush;
+	void *flush_ctx;
+	uint32_t not_first;			/* one bit per nesting level: set once the container has a value */
+	uint8_t depth;
+	bool after_key;
+	bool error;
+}json_writer_t;
+
+/**
+ * @brief Render the cstring provided to a JSON escaped version that can be printed, quotes included.
+ *
+ * Input is read in a single pass. Runs of characters that do not need escaping are copied 4 bytes at a time.
+ *
+ * @param input the input buffer to be escaped. NULL is printed as an empty string.
+ * @param output_buffer the output buffer to write to.
+ * @param output_size the size of output_buffer, null terminator included.
+ * @return the length of the JSON string written, not counting the null terminator. 0 if output_buffer is too small.
+ */
+size_t json_print_string_len(const unsigned char *input, unsigned char *output_buffer, size_t output_size);
+
 /**
  * @brief Render the cstring provided to a JSON escaped version that can be printed.
  * @param input the input buffer to be escaped.
@@ -40,6 +97,98 @@ extern "C" {
  */
 bool json_print_string(const unsigned char *input, unsigned char *output_buffer);
 
+/**
+ * @brief Prepares a writer to produce a document in buffer.
+ * @param flush called with the content of the buffer when it is full. NULL to build the whole document in the buffer.
+ * @param ctx passed as is to the flush callback.
+ */
+void json_writer_init(json_writer_t *writer, char *buffer, size_t size, json_writer_flush_t flush, void *ctx);
+
+bool json_writer_begin_object(json_writer_t *writer);
+bool json_writer_end_object(json_writer_t *writer);
+bool json_writer_begin_array(json_writer_t *writer);
+bool json_writer_end_array(json_writer_t *writer);
+
+/**
+ * @brief Prints the key of the next value of an object. The key is escaped like any other string.
+ */
+bool json_writer_key(json_writer_t *writer, const char *key);
+
+/**
+ * @brief Prints an escaped string value. NULL is printed as an empty string.
+ */
+bool json_writer_string(json_writer_t *writer, const char *str);
+
+bool json_writer_int(json_writer_t *writer, int32_t value);
+bool json_writer_bool(json_writer_t *writer, bool value);
+
+/**
+ * @brief Checks the document is complete and flushes what remains in the buffer.
+ * @return true if the whole document was produced without error.
+ */
+bool json_writer_finish(json_writer_t *writer);
+
+
+/**
+ * @brief Maximum length of a key read by json_reader_t. Longer keys are an error.
+ */
+#define JSON_READER_KEY_SIZE					16
+
+/**
+ * @brief Maximum length of a value read by json_reader_t, once unescaped. Longer values are an error.
+ * Fits a 64 characters WPA passphrase.
+ */
+#define JSON_READER_VALUE_SIZE					72
+
+/**
+ * @brief Function called by a json_reader_t for each member of the object being read.
+ * @param value null terminated. Strings are unescaped, other values are given as written: a number, true, false or null.
+ * @param is_string true if the value was a string.
+ * @return true to go on, false to stop reading with an error.
+ */
+typedef bool (*json_reader_member_t)(void *ctx, const char *key, const char *value, bool is_string);
+
+/**
+ * @brief Streaming JSON reader for a flat object, e.g. {"ssid":"home","password":"secret","channel":6}.
+ *
+ * The document can be fed in pieces of any size as it is received: nothing is allocated and only the member being read
+ * is kept in the reader. Nested objects and arrays are not supported and are reported as errors.
+ *
+ * Errors are sticky: after the first failure every call returns false.
+ */
+typedef struct{
+	json_reader_member_t member;
+	void *ctx;
+	uint8_t state;
+	uint8_t unicode_digits;		/* hex digits of a \uXXXX sequence still expected */
+	uint16_t unicode;
+	bool escape;
+	bool error;
+	size_t key_len;
+	size_t value_len;
+	char key[JSON_READER_KEY_SIZE + 1];
+	char value[JSON_READER_VALUE_SIZE + 1];
+}json_reader_t;
+
+/**
+ * @brief Prepares a reader.
+ * @param member called for each member of the object.
+ * @param ctx passed as is to the member callback.
+ */
+void json_reader_init(json_reader_t *reader, json_reader_member_t member, void *ctx);
+
+/**
+ * @brief Reads the next piece of a document.
+ * @return false if the document is invalid so far, or if the member callback asked to stop.
+ */
+bool json_reader_feed(json_reader_t *reader, const char *data, size_t len);
+
+/**
+ * @brief Checks the whole object was read.
+ * @return true if the document was a complete object without error.
+ */
+bool json_reader_finish(json_reader_t *reader);
+
 #ifdef __cplusplus
 }
 #endif
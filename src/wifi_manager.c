@@ -46,6 +46,7 @@ Contains the freeRTOS task and all necessary support
 #include "esp_netif.h"
 #include "esp_wifi_types.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "nvs.h"
 #include "nvs_flash.h"
 #include "mdns.h"
@@ -58,6 +59,7 @@ Contains the freeRTOS task and all necessary support
 #include "json.h"
 #include "dns_server.h"
 #include "nvs_sync.h"
+#include "diag.h"
 #include "wifi_manager.h"
 
 
@@ -73,17 +75,98 @@ TimerHandle_t wifi_manager_retry_timer = NULL;
  * There is no point hogging a hardware timer for a functionality like this which only needs to be 'accurate enough' */
 TimerHandle_t wifi_manager_shutdown_ap_timer = NULL;
 
+/* @brief periodic software timer checking the signal of the access point when roaming is enabled, NULL otherwise */
+TimerHandle_t wifi_manager_roaming_timer = NULL;
+
 SemaphoreHandle_t wifi_manager_json_mutex = NULL;
 SemaphoreHandle_t wifi_manager_sta_ip_mutex = NULL;
 char *wifi_manager_sta_ip = NULL;
-uint16_t ap_num = MAX_AP_NUM;
+
+/* numeric STA IP. Aligned 32 bit accesses are atomic: it is published without the mutex of the string */
+static volatile uint32_t wifi_manager_sta_ip_addr = 0;
+
+/* mDNS hostname: DEFAULT_HOSTNAME followed by the end of the MAC address so that devices do not conflict */
+static char wifi_manager_hostname[sizeof(DEFAULT_HOSTNAME) + 7] = DEFAULT_HOSTNAME;
+static bool wifi_manager_mdns_started = false;
+uint16_t ap_num = 0;
 wifi_ap_record_t *accessp_records;
-char *accessp_json = NULL;
+
+/**
+ * @brief what was last published of an access point, in the same order as accessp_records.
+ * It tells what changed from one scan to the next.
+ */
+typedef struct{
+	uint8_t ssid[MAX_SSID_SIZE+1];
+	uint8_t authmode;
+	uint8_t primary;
+	int8_t rssi;
+	uint32_t added;		/* generation at which the access point appeared */
+	uint32_t updated;	/* generation at which its channel or rssi last changed */
+}ap_list_state_t;
+
+/**
+ * @brief an access point that disappeared from the list, kept so that deltas can report it.
+ */
+typedef struct{
+	uint8_t ssid[MAX_SSID_SIZE+1];
+	uint8_t authmode;
+	uint32_t removed;	/* generation at which it disappeared, 0 for an unused slot */
+}ap_list_tombstone_t;
+
+static ap_list_state_t *ap_list_state = NULL;
+static uint16_t ap_list_state_num = 0;
+static ap_list_tombstone_t ap_list_tombstones[WIFI_MANAGER_AP_TOMBSTONE_NUM];
+static uint8_t ap_list_tombstone_next = 0;
+
+/* generation of the access point list and oldest generation a delta can be computed from */
+static uint32_t ap_list_generation = 0;
+static uint32_t ap_list_delta_floor = 0;
 char *ip_info_json = NULL;
+
+/* version of the connection status, increased every time ip_info_json is regenerated */
+static uint32_t ip_info_json_version = 0;
 wifi_config_t* wifi_manager_config_sta = NULL;
 
-/* @brief Array of callback function pointers */
-void (**cb_ptr_arr)(void*) = NULL;
+/* @brief Subscribers to the messages of the wifi_manager. A slot without a function is free */
+typedef struct{
+	message_code_t code;
+	void (*func_ptr)(void*);
+	wifi_manager_delivery_t delivery;
+	bool callback;				/* registered with wifi_manager_set_callback: at most one per message code */
+	uint32_t generation;		/* increased every time the slot is freed: deferred messages for a previous subscriber are dropped */
+	uint32_t calls;
+	uint32_t dropped;
+	uint32_t last_us;
+	uint32_t max_us;
+	uint64_t total_us;
+	uint32_t max_wait_us;
+}wifi_manager_subscriber_t;
+
+static wifi_manager_subscriber_t wifi_manager_subscribers[WIFI_MANAGER_MAX_SUBSCRIBERS];
+static portMUX_TYPE wifi_manager_subscribers_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/* @brief A message for a deferred subscriber. The event data its parameter points to is copied along */
+typedef struct{
+	uint8_t subscriber;
+	uint32_t generation;
+	message_code_t code;
+	void (*func_ptr)(void*);
+	void *param;
+	int32_t param_offset;		/* offset of the parameter in event, -1 if it does not point into it */
+	int64_t time;				/* when the message was published, in us */
+	queue_message_event_t event;
+}wifi_manager_deferred_event_t;
+
+/* @brief The wifi_manager_events task and its queue are created with the first deferred subscriber */
+typedef enum{
+	WM_EVENT_TASK_NONE = 0,
+	WM_EVENT_TASK_CREATING = 1,
+	WM_EVENT_TASK_READY = 2
+}wifi_manager_event_task_state_t;
+
+static QueueHandle_t wifi_manager_event_queue = NULL;
+static TaskHandle_t task_wifi_manager_events = NULL;
+static wifi_manager_event_task_state_t wifi_manager_event_task_state = WM_EVENT_TASK_NONE;
 
 /* @brief tag used for ESP serial console messages */
 static const char TAG[] = "wifi_manager";
@@ -97,6 +180,107 @@ static esp_netif_t* esp_netif_sta = NULL;
 /* @brief netif object for the ACCESS POINT */
 static esp_netif_t* esp_netif_ap = NULL;
 
+/**
+ * @brief settings applied together by a power profile.
+ */
+typedef struct{
+	const char *name;
+	wifi_ps_type_t power_save;
+	uint8_t listen_interval;	/* in beacon intervals, only used by WIFI_PS_MAX_MODEM */
+	uint32_t scan_interval_ms;	/* minimum time between two scans: the last list is served in between */
+	uint32_t ap_keep_alive_ms;	/* time the access point stays up once the STA has an IP */
+}wifi_manager_power_profile_config_t;
+
+static const wifi_manager_power_profile_config_t wifi_manager_power_profiles[WIFI_MANAGER_POWER_PROFILE_COUNT] = {
+	{ "performance",	WIFI_PS_NONE,		3,	0,		WIFI_MANAGER_SHUTDOWN_AP_TIMER },
+	{ "balanced",		WIFI_PS_MIN_MODEM,	3,	5000,	WIFI_MANAGER_SHUTDOWN_AP_TIMER },
+	{ "low-power",		WIFI_PS_MAX_MODEM,	10,	30000,	0 }
+};
+
+/* power profile in use and time spent in each profile, in us. since is 0 until a profile is first applied */
+static wifi_manager_power_profile_t wifi_manager_power_profile = WIFI_MANAGER_POWER_PERFORMANCE;
+static uint64_t wifi_manager_power_time_us[WIFI_MANAGER_POWER_PROFILE_COUNT];
+static uint32_t wifi_manager_power_switches = 0;
+static int64_t wifi_manager_power_since = 0;
+static portMUX_TYPE wifi_manager_power_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/* last wifi scan, for the scan interval of the power profile */
+static TickType_t wifi_manager_last_scan = 0;
+static bool wifi_manager_scanned = false;
+
+/* scan in progress: its parameters, the channels of its mask left to scan and the records gathered so far */
+static wifi_manager_scan_params_t wifi_manager_scan_params;
+static uint16_t wifi_manager_scan_channels_left = 0;
+static uint16_t wifi_manager_scan_found = 0;
+static bool wifi_manager_scan_listed = false;
+
+/* scan of the web app: everything that can be seen */
+static const wifi_manager_scan_params_t wifi_manager_scan_full = {
+	.channel_mask = 0,
+	.passive = false,
+	.show_hidden = true,
+	.dwell_ms = 0,
+	.ssid = ""
+};
+
+/* channel of the last access point the STA got an IP from, searched first when the connection is lost. 0 once used */
+static uint8_t wifi_manager_sta_channel = 0;
+
+/* connection requests: the last id issued, the outcome of the last requests, and the request being processed by the task */
+typedef struct{
+	uint32_t id;
+	wifi_manager_connect_status_t status;
+}wifi_manager_connect_outcome_t;
+
+static uint32_t wifi_manager_connect_last_id = 0;
+static wifi_manager_connect_outcome_t wifi_manager_connect_history[WIFI_MANAGER_CONNECT_HISTORY_NUM];
+static uint8_t wifi_manager_connect_history_next = 0;
+static uint32_t wifi_manager_connect_current = 0;
+static portMUX_TYPE wifi_manager_connect_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static const char *wifi_manager_connect_status_names[] = {
+	"unknown",
+	"pending",
+	"connecting",
+	"connected",
+	"failed",
+	"superseded"
+};
+
+/* channels the access point can be placed on when it does not follow the STA, besides DEFAULT_AP_CHANNEL: they do not overlap */
+static const uint8_t wifi_manager_ap_channels[] = { 1, 6, 11 };
+
+/* guards wifi_settings while the wifi_manager task changes it and another task prints it */
+static portMUX_TYPE wifi_manager_settings_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/* the access point config changed while it was down: it is applied when it starts */
+static bool wifi_manager_ap_config_pending = false;
+
+/* indexed by wifi_ps_type_t */
+static const char *wifi_manager_power_save_names[] = {
+	"none",
+	"min_modem",
+	"max_modem"
+};
+
+/**
+ * @brief where the STA is in a handover to another access point of the same SSID.
+ */
+typedef enum{
+	WM_ROAMING_IDLE = 0,	/* no handover in progress */
+	WM_ROAMING_LEAVING,		/* disconnection from the current access point ordered */
+	WM_ROAMING_JOINING		/* connection to the selected access point ordered */
+}wifi_manager_roaming_state_t;
+
+static wifi_manager_roaming_state_t wifi_manager_roaming_state = WM_ROAMING_IDLE;
+static wifi_ap_record_t *wifi_manager_roaming_candidates = NULL;
+static bool wifi_manager_roaming_scan = false;			/* the scan in progress is a roaming scan */
+static bool wifi_manager_roaming_discard = false;		/* the roaming scan was cancelled: its results are ignored */
+static bool wifi_manager_roaming_scanned = false;
+static TickType_t wifi_manager_roaming_last_scan = 0;
+static int8_t wifi_manager_roaming_rssi = 0;			/* average rssi of the current access point, 0 until the first check */
+static uint8_t wifi_manager_roaming_bssid[6];			/* current access point when the roaming scan was started */
+
 /**
  * The actual WiFi settings in use
  */
@@ -164,10 +348,25 @@ void wifi_manager_timer_shutdown_ap_cb( TimerHandle_t xTimer){
 	wifi_manager_send_message(WM_ORDER_STOP_AP, NULL);
 }
 
+void wifi_manager_timer_roaming_cb( TimerHandle_t xTimer ){
+
+	/* check the signal of the access point */
+	wifi_manager_send_message(WM_ORDER_ROAMING_CHECK, NULL);
+}
+
 void wifi_manager_scan_async(){
 	wifi_manager_send_message(WM_ORDER_START_WIFI_SCAN, NULL);
 }
 
+void wifi_manager_scan_with_params_async(const wifi_manager_scan_params_t *params){
+	queue_message msg;
+	msg.code = WM_ORDER_START_WIFI_SCAN;
+	msg.param = (void*)1; /* the parameters are in msg.event.scan */
+	memcpy(&msg.event.scan, params, sizeof(wifi_manager_scan_params_t));
+	msg.event.scan.ssid[MAX_SSID_SIZE] = '\0';
+	xQueueSend( wifi_manager_queue, &msg, portMAX_DELAY);
+}
+
 void wifi_manager_disconnect_async(){
 	wifi_manager_send_message(WM_ORDER_DISCONNECT_STA, NULL);
 }
@@ -185,20 +384,19 @@ void wifi_manager_start(){
 	/* memory allocation */
 	wifi_manager_queue = xQueueCreate( 3, sizeof( queue_message) );
 	wifi_manager_json_mutex = xSemaphoreCreateMutex();
-	accessp_records = (wifi_ap_record_t*)malloc(sizeof(wifi_ap_record_t) * MAX_AP_NUM);
-	accessp_json = (char*)malloc(MAX_AP_NUM * JSON_ONE_APP_SIZE + 4); /* 4 bytes for json encapsulation of "[\n" and "]\0" */
+	accessp_records = (wifi_ap_record_t*)diag_malloc(DIAG_HEAP_SCAN, sizeof(wifi_ap_record_t) * MAX_AP_NUM);
+	/* generations start at a random value so that a client cannot mistake a generation from before a reboot for a current one */
+	ap_list_generation = esp_random() & 0x0fffffff;
+	/* the same goes for connection request ids */
+	wifi_manager_connect_last_id = esp_random() & 0x0fffffff;
 	wifi_manager_clear_access_points_json();
-	ip_info_json = (char*)malloc(sizeof(char) * JSON_IP_INFO_SIZE);
+	ip_info_json = (char*)diag_malloc(DIAG_HEAP_JSON, sizeof(char) * JSON_IP_INFO_SIZE);
 	wifi_manager_clear_ip_info_json();
-	wifi_manager_config_sta = (wifi_config_t*)malloc(sizeof(wifi_config_t));
+	wifi_manager_config_sta = (wifi_config_t*)diag_malloc(DIAG_HEAP_WIFI_MANAGER, sizeof(wifi_config_t));
 	memset(wifi_manager_config_sta, 0x00, sizeof(wifi_config_t));
 	memset(&wifi_settings.sta_static_ip_config, 0x00, sizeof(esp_netif_ip_info_t));
-	cb_ptr_arr = malloc(sizeof(void (*)(void*)) * WM_MESSAGE_CODE_COUNT);
-	for(int i=0; i<WM_MESSAGE_CODE_COUNT; i++){
-		cb_ptr_arr[i] = NULL;
-	}
 	wifi_manager_sta_ip_mutex = xSemaphoreCreateMutex();
-	wifi_manager_sta_ip = (char*)malloc(sizeof(char) * IP4ADDR_STRLEN_MAX);
+	wifi_manager_sta_ip = (char*)diag_malloc(DIAG_HEAP_WIFI_MANAGER, sizeof(char) * IP4ADDR_STRLEN_MAX);
 	wifi_manager_safe_update_sta_ip_string((uint32_t)0);
 	wifi_manager_event_group = xEventGroupCreate();
 
@@ -208,8 +406,15 @@ void wifi_manager_start(){
 	/* create timer for to keep track of AP shutdown */
 	wifi_manager_shutdown_ap_timer = xTimerCreate( NULL, pdMS_TO_TICKS(WIFI_MANAGER_SHUTDOWN_AP_TIMER), pdFALSE, ( void * ) 0, wifi_manager_timer_shutdown_ap_cb);
 
+	/* create timer to periodically check the signal of the access point, and the buffer for the access points that can be roamed to */
+	if(WIFI_MANAGER_ROAMING){
+		wifi_manager_roaming_timer = xTimerCreate( NULL, pdMS_TO_TICKS(WIFI_MANAGER_ROAMING_CHECK_INTERVAL), pdTRUE, ( void * ) 0, wifi_manager_timer_roaming_cb);
+		wifi_manager_roaming_candidates = (wifi_ap_record_t*)diag_malloc(DIAG_HEAP_SCAN, sizeof(wifi_ap_record_t) * WIFI_MANAGER_ROAMING_MAX_CANDIDATES);
+	}
+
 	/* start wifi manager task */
-	xTaskCreate(&wifi_manager, "wifi_manager", 4096, NULL, WIFI_MANAGER_TASK_PRIORITY, &task_wifi_manager);
+	xTaskCreate(&wifi_manager, "wifi_manager", WIFI_MANAGER_TASK_STACK_SIZE, NULL, WIFI_MANAGER_TASK_PRIORITY, &task_wifi_manager);
+	diag_register_task(DIAG_TASK_WIFI_MANAGER, task_wifi_manager, WIFI_MANAGER_TASK_STACK_SIZE);
 }
 
 esp_err_t wifi_manager_save_sta_config(){
@@ -259,7 +464,7 @@ esp_err_t wifi_manager_save_sta_config(){
 				return esp_err;
 			}
 			change = true;
-			ESP_LOGI(TAG, "wifi_manager_wrote wifi_sta_config: password:%s",wifi_manager_config_sta->sta.password);
+			ESP_LOGI(TAG, "wifi_manager_wrote wifi_sta_config: password (not shown)");
 		}
 
 		sz = sizeof(tmp_settings);
@@ -272,7 +477,9 @@ esp_err_t wifi_manager_save_sta_config(){
 				tmp_settings.ap_bandwidth != wifi_settings.ap_bandwidth ||
 				tmp_settings.sta_only != wifi_settings.sta_only ||
 				tmp_settings.sta_power_save != wifi_settings.sta_power_save ||
-				tmp_settings.ap_channel != wifi_settings.ap_channel
+				tmp_settings.ap_channel != wifi_settings.ap_channel ||
+				tmp_settings.sta_static_ip != wifi_settings.sta_static_ip ||
+				memcmp(&tmp_settings.sta_static_ip_config, &wifi_settings.sta_static_ip_config, sizeof(esp_netif_ip_info_t)) != 0
 				)
 		){
 			esp_err = nvs_set_blob(handle, "settings", &wifi_settings, sizeof(wifi_settings));
@@ -283,12 +490,13 @@ esp_err_t wifi_manager_save_sta_config(){
 			change = true;
 
 			ESP_LOGD(TAG, "wifi_manager_wrote wifi_settings: SoftAP_ssid: %s",wifi_settings.ap_ssid);
-			ESP_LOGD(TAG, "wifi_manager_wrote wifi_settings: SoftAP_pwd: %s",wifi_settings.ap_pwd);
+			ESP_LOGD(TAG, "wifi_manager_wrote wifi_settings: SoftAP_pwd set (1 = yes): %i",wifi_settings.ap_pwd[0] != '\0');
 			ESP_LOGD(TAG, "wifi_manager_wrote wifi_settings: SoftAP_channel: %i",wifi_settings.ap_channel);
 			ESP_LOGD(TAG, "wifi_manager_wrote wifi_settings: SoftAP_hidden (1 = yes): %i",wifi_settings.ap_ssid_hidden);
 			ESP_LOGD(TAG, "wifi_manager_wrote wifi_settings: SoftAP_bandwidth (1 = 20MHz, 2 = 40MHz): %i",wifi_settings.ap_bandwidth);
 			ESP_LOGD(TAG, "wifi_manager_wrote wifi_settings: sta_only (0 = APSTA, 1 = STA when connected): %i",wifi_settings.sta_only);
 			ESP_LOGD(TAG, "wifi_manager_wrote wifi_settings: sta_power_save (1 = yes): %i",wifi_settings.sta_power_save);
+			ESP_LOGD(TAG, "wifi_manager_wrote wifi_settings: sta_static_ip (0 = dhcp client, 1 = static ip): %i",wifi_settings.sta_static_ip);
 		}
 
 		if(change){
@@ -325,20 +533,20 @@ bool wifi_manager_fetch_wifi_sta_config(){
 		}
 
 		if(wifi_manager_config_sta == NULL){
-			wifi_manager_config_sta = (wifi_config_t*)malloc(sizeof(wifi_config_t));
+			wifi_manager_config_sta = (wifi_config_t*)diag_malloc(DIAG_HEAP_WIFI_MANAGER, sizeof(wifi_config_t));
 		}
 		memset(wifi_manager_config_sta, 0x00, sizeof(wifi_config_t));
 
 		/* allocate buffer */
 		size_t sz = sizeof(wifi_settings);
-		uint8_t *buff = (uint8_t*)malloc(sizeof(uint8_t) * sz);
+		uint8_t *buff = (uint8_t*)diag_malloc(DIAG_HEAP_WIFI_MANAGER, sizeof(uint8_t) * sz);
 		memset(buff, 0x00, sizeof(sz));
 
 		/* ssid */
 		sz = sizeof(wifi_manager_config_sta->sta.ssid);
 		esp_err = nvs_get_blob(handle, "ssid", buff, &sz);
 		if(esp_err != ESP_OK){
-			free(buff);
+			diag_free(DIAG_HEAP_WIFI_MANAGER, buff);
 			nvs_sync_unlock();
 			return false;
 		}
@@ -348,7 +556,7 @@ bool wifi_manager_fetch_wifi_sta_config(){
 		sz = sizeof(wifi_manager_config_sta->sta.password);
 		esp_err = nvs_get_blob(handle, "password", buff, &sz);
 		if(esp_err != ESP_OK){
-			free(buff);
+			diag_free(DIAG_HEAP_WIFI_MANAGER, buff);
 			nvs_sync_unlock();
 			return false;
 		}
@@ -358,20 +566,20 @@ bool wifi_manager_fetch_wifi_sta_config(){
 		sz = sizeof(wifi_settings);
 		esp_err = nvs_get_blob(handle, "settings", buff, &sz);
 		if(esp_err != ESP_OK){
-			free(buff);
+			diag_free(DIAG_HEAP_WIFI_MANAGER, buff);
 			nvs_sync_unlock();
 			return false;
 		}
 		memcpy(&wifi_settings, buff, sz);
 
-		free(buff);
+		diag_free(DIAG_HEAP_WIFI_MANAGER, buff);
 		nvs_close(handle);
 		nvs_sync_unlock();
 
 
-		ESP_LOGI(TAG, "wifi_manager_fetch_wifi_sta_config: ssid:%s password:%s",wifi_manager_config_sta->sta.ssid,wifi_manager_config_sta->sta.password);
+		ESP_LOGI(TAG, "wifi_manager_fetch_wifi_sta_config: ssid:%s",wifi_manager_config_sta->sta.ssid);
 		ESP_LOGD(TAG, "wifi_manager_fetch_wifi_settings: SoftAP_ssid:%s",wifi_settings.ap_ssid);
-		ESP_LOGD(TAG, "wifi_manager_fetch_wifi_settings: SoftAP_pwd:%s",wifi_settings.ap_pwd);
+		ESP_LOGD(TAG, "wifi_manager_fetch_wifi_settings: SoftAP_pwd set (1 = yes):%i",wifi_settings.ap_pwd[0] != '\0');
 		ESP_LOGD(TAG, "wifi_manager_fetch_wifi_settings: SoftAP_channel:%i",wifi_settings.ap_channel);
 		ESP_LOGD(TAG, "wifi_manager_fetch_wifi_settings: SoftAP_hidden (1 = yes):%i",wifi_settings.ap_ssid_hidden);
 		ESP_LOGD(TAG, "wifi_manager_fetch_wifi_settings: SoftAP_bandwidth (1 = 20MHz, 2 = 40MHz)%i",wifi_settings.ap_bandwidth);
@@ -391,7 +599,25 @@ bool wifi_manager_fetch_wifi_sta_config(){
 
 
 void wifi_manager_clear_ip_info_json(){
-	strcpy(ip_info_json, "{}\n");
+
+	json_writer_t writer;
+
+	ip_info_json_version++;
+
+	json_writer_init(&writer, ip_info_json, JSON_IP_INFO_SIZE, NULL, NULL);
+	json_writer_begin_object(&writer);
+	json_writer_key(&writer, "ver");
+	json_writer_int(&writer, (int32_t)ip_info_json_version);
+	json_writer_end_object(&writer);
+	json_writer_finish(&writer);
+
+	/* wake up the clients waiting for a change of status */
+	http_app_notify_status_changed();
+}
+
+
+uint32_t wifi_manager_get_ip_info_json_version(){
+	return ip_info_json_version;
 }
 
 
@@ -400,43 +626,52 @@ void wifi_manager_generate_ip_info_json(update_reason_code_t update_reason_code)
 	wifi_config_t *config = wifi_manager_get_wifi_sta_config();
 	if(config){
 
-		const char *ip_info_json_format = ",\"ip\":\"%s\",\"netmask\":\"%s\",\"gw\":\"%s\",\"urc\":%d}\n";
-
-		memset(ip_info_json, 0x00, JSON_IP_INFO_SIZE);
+		json_writer_t writer;
+		char ip[IP4ADDR_STRLEN_MAX] = "0"; /* note: IP4ADDR_STRLEN_MAX is defined in lwip */
+		char gw[IP4ADDR_STRLEN_MAX] = "0";
+		char netmask[IP4ADDR_STRLEN_MAX] = "0";
 
-		/* to avoid declaring a new buffer we copy the data directly into the buffer at its correct address */
-		strcpy(ip_info_json, "{\"ssid\":");
-		json_print_string(config->sta.ssid,  (unsigned char*)(ip_info_json+strlen(ip_info_json)) );
+		/* wifi_config_t ssid is not null terminated when it is 32 characters long */
+		char ssid[MAX_SSID_SIZE+1];
+		memcpy(ssid, config->sta.ssid, MAX_SSID_SIZE);
+		ssid[MAX_SSID_SIZE] = '\0';
 
-		size_t ip_info_json_len = strlen(ip_info_json);
-		size_t remaining = JSON_IP_INFO_SIZE - ip_info_json_len;
 		if(update_reason_code == UPDATE_CONNECTION_OK){
 			/* rest of the information is copied after the ssid */
 			esp_netif_ip_info_t ip_info;
 			ESP_ERROR_CHECK(esp_netif_get_ip_info(esp_netif_sta, &ip_info));
 
-			char ip[IP4ADDR_STRLEN_MAX]; /* note: IP4ADDR_STRLEN_MAX is defined in lwip */
-			char gw[IP4ADDR_STRLEN_MAX];
-			char netmask[IP4ADDR_STRLEN_MAX];
-
 			esp_ip4addr_ntoa(&ip_info.ip, ip, IP4ADDR_STRLEN_MAX);
 			esp_ip4addr_ntoa(&ip_info.gw, gw, IP4ADDR_STRLEN_MAX);
 			esp_ip4addr_ntoa(&ip_info.netmask, netmask, IP4ADDR_STRLEN_MAX);
-
-
-			snprintf( (ip_info_json + ip_info_json_len), remaining, ip_info_json_format,
-					ip,
-					netmask,
-					gw,
-					(int)update_reason_code);
+		}
+		/* else: notify in the json output the reason code why this was updated without a connection */
+
+		ip_info_json_version++;
+
+		json_writer_init(&writer, ip_info_json, JSON_IP_INFO_SIZE, NULL, NULL);
+		json_writer_begin_object(&writer);
+		json_writer_key(&writer, "ver");
+		json_writer_int(&writer, (int32_t)ip_info_json_version);
+		json_writer_key(&writer, "ssid");
+		json_writer_string(&writer, ssid);
+		json_writer_key(&writer, "ip");
+		json_writer_string(&writer, ip);
+		json_writer_key(&writer, "netmask");
+		json_writer_string(&writer, netmask);
+		json_writer_key(&writer, "gw");
+		json_writer_string(&writer, gw);
+		json_writer_key(&writer, "urc");
+		json_writer_int(&writer, (int32_t)update_reason_code);
+		json_writer_end_object(&writer);
+
+		if(json_writer_finish(&writer)){
+			/* wake up the clients waiting for a change of status */
+			http_app_notify_status_changed();
 		}
 		else{
-			/* notify in the json output the reason code why this was updated without a connection */
-			snprintf( (ip_info_json + ip_info_json_len), remaining, ip_info_json_format,
-								"0",
-								"0",
-								"0",
-								(int)update_reason_code);
+			ESP_LOGE(TAG, "connection status does not fit in %d bytes", (int)JSON_IP_INFO_SIZE);
+			wifi_manager_clear_ip_info_json();
 		}
 	}
 	else{
@@ -448,38 +683,113 @@ void wifi_manager_generate_ip_info_json(update_reason_code_t update_reason_code)
 
 
 void wifi_manager_clear_access_points_json(){
-	strcpy(accessp_json, "[]\n");
+	ap_num = 0;
+
+	/* changes cannot be tracked through a clear: every client gets the full list */
+	ap_list_state_num = 0;
+	ap_list_generation++;
+	ap_list_delta_floor = ap_list_generation;
 }
-void wifi_manager_generate_acess_points_json(){
 
-	strcpy(accessp_json, "[");
 
+/**
+ * @brief records an access point that disappeared. The oldest record is dropped when there is no room left,
+ * in which case deltas older than its removal can no longer be computed.
+ */
+static void wifi_manager_add_ap_tombstone(const ap_list_state_t *ap, uint32_t generation){
 
-	const char oneap_str[] = ",\"chan\":%d,\"rssi\":%d,\"auth\":%d}%c\n";
+	ap_list_tombstone_t *t = &ap_list_tombstones[ap_list_tombstone_next];
 
-	/* stack buffer to hold on to one AP until it's copied over to accessp_json */
-	char one_ap[JSON_ONE_APP_SIZE];
-	for(int i=0; i<ap_num;i++){
+	if(t->removed != 0 && t->removed > ap_list_delta_floor){
+		ap_list_delta_floor = t->removed;
+	}
 
-		wifi_ap_record_t ap = accessp_records[i];
+	memcpy(t->ssid, ap->ssid, sizeof(t->ssid));
+	t->authmode = ap->authmode;
+	t->removed = generation;
+
+	ap_list_tombstone_next = (ap_list_tombstone_next + 1) % WIFI_MANAGER_AP_TOMBSTONE_NUM;
+}
 
-		/* ssid needs to be json escaped. To save on heap memory it's directly printed at the correct address */
-		strcat(accessp_json, "{\"ssid\":");
-		json_print_string( (unsigned char*)ap.ssid,  (unsigned char*)(accessp_json+strlen(accessp_json)) );
 
-		/* print the rest of the json for this access point: no more string to escape */
-		snprintf(one_ap, (size_t)JSON_ONE_APP_SIZE, oneap_str,
-				ap.primary,
-				ap.rssi,
-				ap.authmode,
-				i==ap_num-1?']':',');
+/**
+ * @brief compares the access points of a new scan with the ones of the previous scan and moves to a new generation
+ * if anything changed. rssi variations under WIFI_MANAGER_AP_RSSI_HYSTERESIS are not reported: the previous value is kept
+ * so that a list that did not really change is never sent again.
+ * @note must be called with the json mutex taken, after wifi_manager_filter_unique.
+ */
+static void wifi_manager_update_ap_list_generation(){
 
-		/* add it to the list */
-		strcat(accessp_json, one_ap);
+	uint32_t generation = ap_list_generation + 1;
+	bool changed = false;
+	ap_list_state_t *state = (ap_list_state_t*)diag_malloc(DIAG_HEAP_SCAN, sizeof(ap_list_state_t) * MAX_AP_NUM);
+
+	if(state == NULL){
+		/* changes cannot be tracked: every client gets the full list */
+		ESP_LOGE(TAG, "could not allocate the access point list state");
+		wifi_manager_clear_access_points_json();
+		return;
 	}
 
-}
+	/* access points that are new or that changed */
+	for(int i=0; i<ap_num; i++){
+
+		wifi_ap_record_t *ap = &accessp_records[i];
+		ap_list_state_t *prev = NULL;
+
+		for(int j=0; j<ap_list_state_num; j++){
+			if(ap_list_state[j].authmode == ap->authmode && strcmp((char*)ap_list_state[j].ssid, (char*)ap->ssid) == 0){
+				prev = &ap_list_state[j];
+				break;
+			}
+		}
+
+		memcpy(state[i].ssid, ap->ssid, sizeof(state[i].ssid));
+		state[i].authmode = ap->authmode;
+
+		if(prev == NULL){
+			state[i].added = generation;
+			state[i].updated = generation;
+			changed = true;
+		}
+		else{
+			state[i].added = prev->added;
+			if(prev->primary != ap->primary || abs(ap->rssi - prev->rssi) >= WIFI_MANAGER_AP_RSSI_HYSTERESIS){
+				state[i].updated = generation;
+				changed = true;
+			}
+			else{
+				state[i].updated = prev->updated;
+				ap->rssi = prev->rssi;
+			}
+		}
+
+		state[i].primary = ap->primary;
+		state[i].rssi = ap->rssi;
+	}
+
+	/* access points that are gone */
+	for(int j=0; j<ap_list_state_num; j++){
+
+		bool found = false;
+		for(int i=0; i<ap_num && !found; i++){
+			found = state[i].authmode == ap_list_state[j].authmode && strcmp((char*)state[i].ssid, (char*)ap_list_state[j].ssid) == 0;
+		}
+
+		if(!found){
+			wifi_manager_add_ap_tombstone(&ap_list_state[j], generation);
+			changed = true;
+		}
+	}
 
+	diag_free(DIAG_HEAP_SCAN, ap_list_state);
+	ap_list_state = state;
+	ap_list_state_num = ap_num;
+
+	if(changed){
+		ap_list_generation = generation;
+	}
+}
 
 
 bool wifi_manager_lock_sta_ip_string(TickType_t xTicksToWait){
@@ -502,6 +812,8 @@ void wifi_manager_unlock_sta_ip_string(){
 
 void wifi_manager_safe_update_sta_ip_string(uint32_t ip){
 
+	wifi_manager_sta_ip_addr = ip;
+
 	if(wifi_manager_lock_sta_ip_string(portMAX_DELAY)){
 
 		esp_ip4_addr_t ip4;
@@ -522,6 +834,642 @@ char* wifi_manager_get_sta_ip_string(){
 	return wifi_manager_sta_ip;
 }
 
+void wifi_manager_initialise_mdns(){
+
+	/* mDNS is started once and never restarted: its records are registered here only, and the mdns component
+	 * itself announces them on each interface when it comes up (AP start, STA got IP) */
+	if(wifi_manager_mdns_started){
+		return;
+	}
+
+	uint8_t mac[6];
+	if(esp_read_mac(mac, ESP_MAC_WIFI_STA) == ESP_OK){
+		snprintf(wifi_manager_hostname, sizeof(wifi_manager_hostname), "%s-%02x%02x%02x", DEFAULT_HOSTNAME, mac[3], mac[4], mac[5]);
+	}
+
+	esp_err_t err = mdns_init();
+	if(err != ESP_OK){
+		ESP_LOGE(TAG, "mdns_init failed: %s", esp_err_to_name(err));
+		return;
+	}
+
+	mdns_hostname_set(wifi_manager_hostname);
+	mdns_instance_name_set(wifi_manager_hostname);
+
+	mdns_txt_item_t txt[] = {
+		{ "path", WEBAPP_LOCATION }
+	};
+	err = mdns_service_add(NULL, "_http", "_tcp", 80, txt, sizeof(txt) / sizeof(txt[0]));
+	if(err != ESP_OK){
+		ESP_LOGE(TAG, "mdns_service_add failed: %s", esp_err_to_name(err));
+	}
+
+	wifi_manager_mdns_started = true;
+	ESP_LOGI(TAG, "mDNS hostname: %s.local", wifi_manager_hostname);
+}
+
+const char* wifi_manager_get_hostname(){
+	return wifi_manager_hostname;
+}
+
+
+/**
+ * @brief returns the power profile that matches a power save mode, performance if none does.
+ */
+static wifi_manager_power_profile_t wifi_manager_power_profile_from_ps(wifi_ps_type_t power_save){
+	for(int i=0; i<WIFI_MANAGER_POWER_PROFILE_COUNT; i++){
+		if(wifi_manager_power_profiles[i].power_save == power_save){
+			return (wifi_manager_power_profile_t)i;
+		}
+	}
+	return WIFI_MANAGER_POWER_PERFORMANCE;
+}
+
+/**
+ * @brief switches to a power profile. Must be called from the wifi_manager task.
+ */
+static void wifi_manager_apply_power_profile(wifi_manager_power_profile_t profile){
+
+	const wifi_manager_power_profile_config_t *config = &wifi_manager_power_profiles[profile];
+	int64_t now = esp_timer_get_time();
+
+	portENTER_CRITICAL(&wifi_manager_power_mux);
+	if(wifi_manager_power_since != 0){
+		wifi_manager_power_time_us[wifi_manager_power_profile] += now - wifi_manager_power_since;
+		if(profile != wifi_manager_power_profile){
+			wifi_manager_power_switches++;
+		}
+	}
+	wifi_manager_power_since = now;
+	wifi_manager_power_profile = profile;
+	portEXIT_CRITICAL(&wifi_manager_power_mux);
+
+	/* saved with the rest of the settings */
+	portENTER_CRITICAL(&wifi_manager_settings_mux);
+	wifi_settings.sta_power_save = config->power_save;
+	portEXIT_CRITICAL(&wifi_manager_settings_mux);
+
+	esp_err_t err = esp_wifi_set_ps(config->power_save);
+	if(err != ESP_OK){
+		ESP_LOGW(TAG, "esp_wifi_set_ps failed: %s", esp_err_to_name(err));
+	}
+
+	ESP_LOGI(TAG, "Power profile: %s", config->name);
+}
+
+/**
+ * @brief starts the scan of the next channel of the mask, or of all channels if there is no mask. Must be called from the wifi_manager task.
+ */
+static esp_err_t wifi_manager_scan_next(){
+
+	const wifi_manager_scan_params_t *params = &wifi_manager_scan_params;
+	uint8_t channel = 0;
+
+	if(wifi_manager_scan_channels_left){
+		while( !(wifi_manager_scan_channels_left & WIFI_MANAGER_SCAN_CHANNEL(channel)) ){
+			channel++;
+		}
+		wifi_manager_scan_channels_left &= ~WIFI_MANAGER_SCAN_CHANNEL(channel);
+	}
+
+	wifi_scan_config_t scan_config = {
+		.ssid = params->ssid[0] ? (uint8_t*)params->ssid : NULL,
+		.bssid = NULL,
+		.channel = channel,
+		.show_hidden = params->show_hidden,
+		.scan_type = params->passive ? WIFI_SCAN_TYPE_PASSIVE : WIFI_SCAN_TYPE_ACTIVE
+	};
+
+	/* 0 leaves the driver default */
+	if(params->passive){
+		scan_config.scan_time.passive = params->dwell_ms;
+	}
+	else{
+		scan_config.scan_time.active.max = params->dwell_ms;
+	}
+
+	return esp_wifi_scan_start(&scan_config, false);
+}
+
+/**
+ * @brief starts a scan. Must be called from the wifi_manager task, with no scan in progress.
+ * @param roaming true if the results are candidates for a handover, false if they refresh the access point list.
+ */
+static esp_err_t wifi_manager_scan_start(const wifi_manager_scan_params_t *params, bool roaming){
+
+	memcpy(&wifi_manager_scan_params, params, sizeof(wifi_manager_scan_params_t));
+	wifi_manager_scan_channels_left = params->channel_mask & WIFI_MANAGER_SCAN_CHANNELS_VALID;
+	wifi_manager_scan_found = 0;
+	wifi_manager_scan_listed = false;
+	wifi_manager_roaming_scan = roaming;
+	wifi_manager_roaming_discard = false;
+
+	/* cleared once all the channels are scanned */
+	xEventGroupSetBits(wifi_manager_event_group, WIFI_MANAGER_SCAN_BIT);
+
+	esp_err_t err = wifi_manager_scan_next();
+	if(err != ESP_OK){
+		ESP_LOGW(TAG, "esp_wifi_scan_start failed: %s", esp_err_to_name(err));
+		xEventGroupClearBits(wifi_manager_event_group, WIFI_MANAGER_SCAN_BIT);
+		wifi_manager_scan_channels_left = 0;
+		wifi_manager_roaming_scan = false;
+	}
+
+	return err;
+}
+
+/**
+ * @brief forgets the scan in progress when it is cancelled by a disconnection or a connection order.
+ * A roaming scan is dropped altogether: its records are neither listed nor used for a handover.
+ * Must be called from the wifi_manager task.
+ */
+static void wifi_manager_scan_cancel(){
+
+	wifi_manager_scan_channels_left = 0;
+	if(wifi_manager_roaming_scan){
+		wifi_manager_roaming_scan = false;
+		wifi_manager_roaming_discard = true;
+	}
+}
+
+/**
+ * @brief forgets the access point the STA was pinned to for a handover. Must be called from the wifi_manager task.
+ * A handover that was still in progress is accounted as failed.
+ */
+static void wifi_manager_roaming_reset(){
+
+	if(wifi_manager_roaming_state == WM_ROAMING_IDLE){
+		return;
+	}
+
+	diag_mark(DIAG_MARK_HANDOVER_FAILED);
+	wifi_manager_roaming_state = WM_ROAMING_IDLE;
+
+	/* the next connection is free to pick any access point of the SSID again */
+	wifi_config_t *config = wifi_manager_get_wifi_sta_config();
+	config->sta.bssid_set = false;
+	config->sta.channel = 0;
+	esp_wifi_set_config(ESP_IF_WIFI_STA, config);
+}
+
+/**
+ * @brief starts a scan of the current SSID if the signal of the access point got weak. Must be called from the wifi_manager task.
+ */
+static void wifi_manager_roaming_check(){
+
+	wifi_ap_record_t ap;
+	EventBits_t uxBits = xEventGroupGetBits(wifi_manager_event_group);
+
+	if(wifi_manager_roaming_state != WM_ROAMING_IDLE || !(uxBits & WIFI_MANAGER_WIFI_CONNECTED_BIT) || (uxBits & WIFI_MANAGER_SCAN_BIT)){
+		return;
+	}
+
+	/* the connection request asked for this very access point */
+	if(wifi_manager_get_wifi_sta_config()->sta.bssid_set){
+		return;
+	}
+	if(esp_wifi_sta_get_ap_info(&ap) != ESP_OK){
+		return;
+	}
+
+	/* a single weak beacon is not a reason to leave */
+	wifi_manager_roaming_rssi = wifi_manager_roaming_rssi == 0 ? ap.rssi : (3 * wifi_manager_roaming_rssi + ap.rssi) / 4;
+	if(wifi_manager_roaming_rssi >= WIFI_MANAGER_ROAMING_RSSI_THRESHOLD){
+		return;
+	}
+
+	/* the radio leaves the channel of the access point while scanning: the scans are rationed */
+	if(wifi_manager_roaming_scanned && xTaskGetTickCount() - wifi_manager_roaming_last_scan < pdMS_TO_TICKS(WIFI_MANAGER_ROAMING_SCAN_INTERVAL)){
+		return;
+	}
+
+	/* probe for the SSID on a few channels, one at a time, so that the radio is never away from the access point for long */
+	wifi_manager_scan_params_t params = {
+		.channel_mask = WIFI_MANAGER_ROAMING_SCAN_CHANNELS | WIFI_MANAGER_SCAN_CHANNEL(ap.primary),
+		.passive = false,
+		.show_hidden = false,
+		.dwell_ms = WIFI_MANAGER_ROAMING_SCAN_DWELL
+	};
+	memcpy(params.ssid, ap.ssid, sizeof(params.ssid));
+	params.ssid[MAX_SSID_SIZE] = '\0';
+
+	ESP_LOGI(TAG, "Weak signal (%d dBm): looking for another access point of %s", wifi_manager_roaming_rssi, params.ssid);
+	memcpy(wifi_manager_roaming_bssid, ap.bssid, sizeof(wifi_manager_roaming_bssid));
+	wifi_manager_roaming_last_scan = xTaskGetTickCount();
+	wifi_manager_roaming_scanned = true;
+	if(wifi_manager_scan_start(&params, true) == ESP_OK){
+		diag_count(DIAG_COUNTER_ROAMING_SCANS);
+	}
+}
+
+/**
+ * @brief hands over to the strongest access point found by a roaming scan, if it is enough of an improvement.
+ * Must be called from the wifi_manager task.
+ */
+static void wifi_manager_roaming_select(const wifi_ap_record_t *records, uint16_t num){
+
+	const wifi_ap_record_t *best = NULL;
+
+	/* the candidates are only worth something while the STA is still on the access point it wants to leave */
+	if(!(xEventGroupGetBits(wifi_manager_event_group) & WIFI_MANAGER_WIFI_CONNECTED_BIT)){
+		return;
+	}
+
+	for(int i=0; i<num; i++){
+		if(memcmp(records[i].bssid, wifi_manager_roaming_bssid, sizeof(wifi_manager_roaming_bssid)) != 0 &&
+			records[i].rssi >= wifi_manager_roaming_rssi + WIFI_MANAGER_ROAMING_HYSTERESIS &&
+			(best == NULL || records[i].rssi > best->rssi)){
+			best = &records[i];
+		}
+	}
+
+	if(best == NULL){
+		return;
+	}
+
+	/* pin the access point: the reconnection must not pick the one that is being left */
+	wifi_config_t *config = wifi_manager_get_wifi_sta_config();
+	config->sta.bssid_set = true;
+	memcpy(config->sta.bssid, best->bssid, sizeof(config->sta.bssid));
+	config->sta.channel = best->primary;
+	if(esp_wifi_set_config(ESP_IF_WIFI_STA, config) != ESP_OK){
+		config->sta.bssid_set = false;
+		config->sta.channel = 0;
+		return;
+	}
+
+	ESP_LOGI(TAG, "Handover to %02x:%02x:%02x:%02x:%02x:%02x (%d dBm, channel %d)",
+			best->bssid[0], best->bssid[1], best->bssid[2], best->bssid[3], best->bssid[4], best->bssid[5], best->rssi, best->primary);
+	wifi_manager_roaming_state = WM_ROAMING_LEAVING;
+	diag_mark(DIAG_MARK_HANDOVER_ORDER);
+	esp_wifi_disconnect();
+}
+
+/**
+ * @brief carries a handover on when the STA gets disconnected. Must be called from the wifi_manager task.
+ * @return true if the disconnection is part of a handover, false if it must be handled as a lost connection.
+ */
+static bool wifi_manager_roaming_disconnected(){
+
+	if(wifi_manager_roaming_state == WM_ROAMING_LEAVING){
+		wifi_manager_roaming_state = WM_ROAMING_JOINING;
+		if(esp_wifi_connect() == ESP_OK){
+			return true;
+		}
+	}
+
+	/* the selected access point could not be joined */
+	wifi_manager_roaming_reset();
+	return false;
+}
+
+/**
+ * @brief picks the channel of the access point. Must be called from the wifi_manager task.
+ * The radio has a single channel: the access point goes where the STA is, or where it is about to connect if the saved
+ * network was seen in the last scan. Otherwise it goes to the least congested channel of the last scan.
+ */
+static uint8_t wifi_manager_pick_ap_channel(){
+
+	wifi_ap_record_t ap;
+	wifi_config_t *config = wifi_manager_get_wifi_sta_config();
+	uint32_t load[15];
+	uint8_t channel = wifi_settings.ap_channel;
+
+	if(esp_wifi_sta_get_ap_info(&ap) == ESP_OK){
+		return ap.primary;
+	}
+
+	for(int i=0; i<ap_num; i++){
+		/* sta.ssid is not null terminated when the SSID is 32 characters long */
+		if(config->sta.ssid[0] != '\0' && strncmp((char*)accessp_records[i].ssid, (char*)config->sta.ssid, MAX_SSID_SIZE) == 0){
+			return accessp_records[i].primary;
+		}
+	}
+
+	/* a 20 MHz channel overlaps the 4 channels on each side: the closer and the stronger a network, the more it weighs */
+	memset(load, 0x00, sizeof(load));
+	for(int i=0; i<ap_num; i++){
+		int primary = accessp_records[i].primary;
+		int strength = accessp_records[i].rssi + 100;
+		if(strength < 1) strength = 1;
+		for(int c = primary - 4; c <= primary + 4; c++){
+			if(c >= 1 && c <= 14){
+				load[c] += strength * (5 - abs(c - primary));
+			}
+		}
+	}
+
+	/* the configured channel wins ties */
+	if(channel < 1 || channel > 14){
+		channel = DEFAULT_AP_CHANNEL;
+	}
+	for(int i=0; i<sizeof(wifi_manager_ap_channels); i++){
+		if(load[wifi_manager_ap_channels[i]] < load[channel]){
+			channel = wifi_manager_ap_channels[i];
+		}
+	}
+
+	return channel;
+}
+
+/**
+ * @brief copies the SSID, password and visibility of the access point from wifi_settings to its config.
+ */
+static void wifi_manager_set_ap_credentials(wifi_config_t *ap_config){
+
+	memcpy(ap_config->ap.ssid, wifi_settings.ap_ssid, sizeof(wifi_settings.ap_ssid));
+	ap_config->ap.ssid_len = strnlen((char*)wifi_settings.ap_ssid, sizeof(wifi_settings.ap_ssid));
+	ap_config->ap.ssid_hidden = wifi_settings.ap_ssid_hidden;
+
+	/* if the password lenght is under 8 char which is the minium for WPA2, the access point starts as open */
+	if(strnlen( (char*)wifi_settings.ap_pwd, sizeof(wifi_settings.ap_pwd)) < WPA2_MINIMUM_PASSWORD_LENGTH){
+		ap_config->ap.authmode = WIFI_AUTH_OPEN;
+		memset( ap_config->ap.password, 0x00, sizeof(ap_config->ap.password) );
+	}
+	else{
+		ap_config->ap.authmode = WIFI_AUTH_WPA2_PSK;
+		memcpy(ap_config->ap.password, wifi_settings.ap_pwd, sizeof(wifi_settings.ap_pwd));
+	}
+}
+
+/**
+ * @brief stops the access point after the keep alive time of the power profile. Must be called from the wifi_manager task.
+ */
+static void wifi_manager_schedule_ap_shutdown(){
+
+	TickType_t t = pdMS_TO_TICKS( wifi_manager_power_profiles[wifi_manager_power_profile].ap_keep_alive_ms );
+
+	/* if for whatever reason user configured the shutdown timer to be less than 1 tick, the AP is stopped straight away */
+	if(t > 0){
+		/* changing the period starts the timer */
+		xTimerChangePeriod( wifi_manager_shutdown_ap_timer, t, (TickType_t)0 );
+	}
+	else{
+		wifi_manager_send_message(WM_ORDER_STOP_AP, (void*)NULL);
+	}
+}
+
+/**
+ * @brief moves the access point to a channel. Must be called from the wifi_manager task.
+ * @return true if the channel changed.
+ */
+static bool wifi_manager_set_ap_channel(wifi_config_t *ap_config, uint8_t channel){
+
+	if(channel == 0 || ap_config->ap.channel == channel){
+		return false;
+	}
+
+	ESP_LOGI(TAG, "Access point channel: %d -> %d", ap_config->ap.channel, channel);
+	ap_config->ap.channel = channel;
+	esp_err_t err = esp_wifi_set_config(ESP_IF_WIFI_AP, ap_config);
+	if(err != ESP_OK){
+		ESP_LOGW(TAG, "esp_wifi_set_config failed: %s", esp_err_to_name(err));
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * @brief applies a change set of wifi_settings, then saves the settings. Must be called from the wifi_manager task.
+ */
+static void wifi_manager_apply_settings(wifi_config_t *ap_config, const wifi_manager_settings_change_t *change){
+
+	const struct wifi_settings_t *settings = &change->settings;
+	uint16_t fields = change->fields;
+	EventBits_t uxBits = xEventGroupGetBits(wifi_manager_event_group);
+	esp_err_t err = ESP_OK;
+
+	portENTER_CRITICAL(&wifi_manager_settings_mux);
+	if(fields & WM_SETTING_AP_SSID) memcpy(wifi_settings.ap_ssid, settings->ap_ssid, sizeof(wifi_settings.ap_ssid));
+	if(fields & WM_SETTING_AP_PWD) memcpy(wifi_settings.ap_pwd, settings->ap_pwd, sizeof(wifi_settings.ap_pwd));
+	if(fields & WM_SETTING_AP_CHANNEL) wifi_settings.ap_channel = settings->ap_channel;
+	if(fields & WM_SETTING_AP_SSID_HIDDEN) wifi_settings.ap_ssid_hidden = settings->ap_ssid_hidden;
+	if(fields & WM_SETTING_AP_BANDWIDTH) wifi_settings.ap_bandwidth = settings->ap_bandwidth;
+	if(fields & WM_SETTING_STA_ONLY) wifi_settings.sta_only = settings->sta_only;
+	if(fields & WM_SETTING_STA_STATIC_IP) wifi_settings.sta_static_ip = settings->sta_static_ip;
+	if(fields & WM_SETTING_STA_IP) wifi_settings.sta_static_ip_config.ip = settings->sta_static_ip_config.ip;
+	if(fields & WM_SETTING_STA_NETMASK) wifi_settings.sta_static_ip_config.netmask = settings->sta_static_ip_config.netmask;
+	if(fields & WM_SETTING_STA_GW) wifi_settings.sta_static_ip_config.gw = settings->sta_static_ip_config.gw;
+	portEXIT_CRITICAL(&wifi_manager_settings_mux);
+
+	/* the access point is reconfigured without restarting the driver. A stopped access point gets its config when it starts */
+	if(fields & (WM_SETTING_AP_SSID | WM_SETTING_AP_PWD | WM_SETTING_AP_CHANNEL | WM_SETTING_AP_SSID_HIDDEN | WM_SETTING_AP_BANDWIDTH)){
+
+		wifi_manager_set_ap_credentials(ap_config);
+
+		/* while the STA is connected the access point shares its channel */
+		if((fields & WM_SETTING_AP_CHANNEL) && !(uxBits & WIFI_MANAGER_WIFI_CONNECTED_BIT)){
+			ap_config->ap.channel = wifi_settings.ap_channel;
+		}
+
+		if(uxBits & WIFI_MANAGER_AP_STARTED_BIT){
+			err = esp_wifi_set_config(ESP_IF_WIFI_AP, ap_config);
+			if(err == ESP_OK && (fields & WM_SETTING_AP_BANDWIDTH)){
+				err = esp_wifi_set_bandwidth(WIFI_IF_AP, wifi_settings.ap_bandwidth);
+			}
+			if(err != ESP_OK){
+				ESP_LOGW(TAG, "access point settings not applied: %s", esp_err_to_name(err));
+			}
+		}
+		else{
+			wifi_manager_ap_config_pending = true;
+		}
+	}
+
+	if(fields & WM_SETTING_STA_POWER_SAVE){
+		wifi_manager_apply_power_profile(wifi_manager_power_profile_from_ps(settings->sta_power_save));
+	}
+
+	/* the access point of a connected STA is shut down as if the connection was just made, or kept up. Once down it stays down until the connection is lost */
+	if((fields & WM_SETTING_STA_ONLY) && (uxBits & WIFI_MANAGER_WIFI_CONNECTED_BIT) && (uxBits & WIFI_MANAGER_AP_STARTED_BIT)){
+		if(wifi_settings.sta_only){
+			wifi_manager_schedule_ap_shutdown();
+		}
+		else if(xTimerIsTimerActive(wifi_manager_shutdown_ap_timer) == pdTRUE){
+			xTimerStop( wifi_manager_shutdown_ap_timer, (TickType_t)0 );
+		}
+	}
+
+	/* the static IP config is used from the next connection: changing the address now would drop the client that made the change */
+
+	/* a single write for the whole change set */
+	err = wifi_manager_save_sta_config();
+	if(err != ESP_OK){
+		ESP_LOGW(TAG, "settings not saved: %s", esp_err_to_name(err));
+	}
+}
+
+esp_err_t wifi_manager_set_power_profile_async(wifi_manager_power_profile_t profile){
+	queue_message msg;
+	msg.code = WM_ORDER_SET_POWER_PROFILE;
+	msg.param = (void*)profile;
+	memset(&msg.event, 0x00, sizeof(msg.event));
+
+	/* never wait for room in the queue: the caller may be the http server */
+	return xQueueSend( wifi_manager_queue, &msg, 0) == pdPASS ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
+wifi_manager_power_profile_t wifi_manager_get_power_profile(){
+	return wifi_manager_power_profile;
+}
+
+const char* wifi_manager_get_power_profile_name(wifi_manager_power_profile_t profile){
+	return profile < WIFI_MANAGER_POWER_PROFILE_COUNT ? wifi_manager_power_profiles[profile].name : "";
+}
+
+bool wifi_manager_get_power_profile_by_name(const char *name, wifi_manager_power_profile_t *profile){
+	for(int i=0; i<WIFI_MANAGER_POWER_PROFILE_COUNT; i++){
+		if(strcmp(name, wifi_manager_power_profiles[i].name) == 0){
+			*profile = (wifi_manager_power_profile_t)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+void wifi_manager_get_power_report(wifi_manager_power_report_t *report){
+
+	int64_t now = esp_timer_get_time();
+
+	portENTER_CRITICAL(&wifi_manager_power_mux);
+	report->profile = wifi_manager_power_profile;
+	report->switches = wifi_manager_power_switches;
+	for(int i=0; i<WIFI_MANAGER_POWER_PROFILE_COUNT; i++){
+		report->time_ms[i] = wifi_manager_power_time_us[i] / 1000;
+	}
+	if(wifi_manager_power_since != 0){
+		report->time_ms[wifi_manager_power_profile] += (now - wifi_manager_power_since) / 1000;
+	}
+	portEXIT_CRITICAL(&wifi_manager_power_mux);
+}
+
+bool wifi_manager_get_power_json(json_writer_t *writer){
+
+	wifi_manager_power_report_t report;
+
+	wifi_manager_get_power_report(&report);
+
+	json_writer_begin_object(writer);
+	json_writer_key(writer, "profile");
+	json_writer_string(writer, wifi_manager_get_power_profile_name(report.profile));
+	json_writer_key(writer, "switches");
+	json_writer_int(writer, (int32_t)report.switches);
+	json_writer_key(writer, "time");
+	json_writer_begin_object(writer);
+	for(int i=0; i<WIFI_MANAGER_POWER_PROFILE_COUNT; i++){
+		json_writer_key(writer, wifi_manager_power_profiles[i].name);
+		json_writer_int(writer, (int32_t)(report.time_ms[i] / 1000));
+	}
+	json_writer_end_object(writer);
+
+	return json_writer_end_object(writer);
+}
+
+bool wifi_manager_get_power_save_by_name(const char *name, wifi_ps_type_t *power_save){
+	for(int i=0; i<sizeof(wifi_manager_power_save_names)/sizeof(wifi_manager_power_save_names[0]); i++){
+		if(strcmp(name, wifi_manager_power_save_names[i]) == 0){
+			*power_save = (wifi_ps_type_t)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+esp_err_t wifi_manager_update_settings_async(const wifi_manager_settings_change_t *change){
+
+	const struct wifi_settings_t *settings = &change->settings;
+	queue_message msg;
+	size_t len;
+	esp_err_t err;
+
+	/* only the fields of the change set are checked: the others are not read */
+	if(change->fields & WM_SETTING_AP_SSID){
+		/* one byte is kept for the terminating zero: the SSID is compared as a string when it is saved */
+		len = strnlen((char*)settings->ap_ssid, sizeof(settings->ap_ssid));
+		if(len == 0 || len == sizeof(settings->ap_ssid)) return ESP_ERR_INVALID_ARG;
+	}
+	if(change->fields & WM_SETTING_AP_PWD){
+		/* empty for an open access point */
+		len = strnlen((char*)settings->ap_pwd, sizeof(settings->ap_pwd));
+		if(len == sizeof(settings->ap_pwd) || (len > 0 && len < WPA2_MINIMUM_PASSWORD_LENGTH)) return ESP_ERR_INVALID_ARG;
+	}
+	if((change->fields & WM_SETTING_AP_CHANNEL) && (settings->ap_channel < 1 || settings->ap_channel > 13)){
+		return ESP_ERR_INVALID_ARG;
+	}
+	if((change->fields & WM_SETTING_AP_BANDWIDTH) && settings->ap_bandwidth != WIFI_BW_HT20 && settings->ap_bandwidth != WIFI_BW_HT40){
+		return ESP_ERR_INVALID_ARG;
+	}
+	if((change->fields & WM_SETTING_STA_POWER_SAVE) && (unsigned)settings->sta_power_save > WIFI_PS_MAX_MODEM){
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	msg.code = WM_ORDER_UPDATE_SETTINGS;
+	msg.param = NULL;
+	memset(&msg.event, 0x00, sizeof(msg.event));
+	memcpy(&msg.event.settings, change, sizeof(wifi_manager_settings_change_t));
+
+	/* never wait for room in the queue: the caller may be the http server */
+	err = xQueueSend( wifi_manager_queue, &msg, 0) == pdPASS ? ESP_OK : ESP_ERR_TIMEOUT;
+
+	memset(msg.event.settings.settings.ap_pwd, 0x00, sizeof(msg.event.settings.settings.ap_pwd));
+	return err;
+}
+
+bool wifi_manager_get_settings_json(json_writer_t *writer){
+
+	struct wifi_settings_t settings;
+	char ssid[MAX_SSID_SIZE+1];
+	char ip[IP4ADDR_STRLEN_MAX];
+	char netmask[IP4ADDR_STRLEN_MAX];
+	char gw[IP4ADDR_STRLEN_MAX];
+	bool open;
+
+	portENTER_CRITICAL(&wifi_manager_settings_mux);
+	memcpy(&settings, &wifi_settings, sizeof(settings));
+	portEXIT_CRITICAL(&wifi_manager_settings_mux);
+
+	/* the password is write only */
+	open = strnlen((char*)settings.ap_pwd, sizeof(settings.ap_pwd)) < WPA2_MINIMUM_PASSWORD_LENGTH;
+	memset(settings.ap_pwd, 0x00, sizeof(settings.ap_pwd));
+
+	memcpy(ssid, settings.ap_ssid, MAX_SSID_SIZE);
+	ssid[MAX_SSID_SIZE] = '\0';
+	esp_ip4addr_ntoa(&settings.sta_static_ip_config.ip, ip, IP4ADDR_STRLEN_MAX);
+	esp_ip4addr_ntoa(&settings.sta_static_ip_config.netmask, netmask, IP4ADDR_STRLEN_MAX);
+	esp_ip4addr_ntoa(&settings.sta_static_ip_config.gw, gw, IP4ADDR_STRLEN_MAX);
+
+	json_writer_begin_object(writer);
+	json_writer_key(writer, "ap_ssid");
+	json_writer_string(writer, ssid);
+	json_writer_key(writer, "ap_open");
+	json_writer_bool(writer, open);
+	json_writer_key(writer, "ap_channel");
+	json_writer_int(writer, settings.ap_channel);
+	json_writer_key(writer, "ap_ssid_hidden");
+	json_writer_bool(writer, settings.ap_ssid_hidden != 0);
+	json_writer_key(writer, "ap_bandwidth");
+	json_writer_int(writer, settings.ap_bandwidth == WIFI_BW_HT40 ? 40 : 20);
+	json_writer_key(writer, "sta_only");
+	json_writer_bool(writer, settings.sta_only);
+	json_writer_key(writer, "sta_power_save");
+	json_writer_string(writer, (unsigned)settings.sta_power_save <= WIFI_PS_MAX_MODEM ? wifi_manager_power_save_names[settings.sta_power_save] : "");
+	json_writer_key(writer, "sta_static_ip");
+	json_writer_bool(writer, settings.sta_static_ip);
+	json_writer_key(writer, "sta_ip");
+	json_writer_string(writer, ip);
+	json_writer_key(writer, "sta_netmask");
+	json_writer_string(writer, netmask);
+	json_writer_key(writer, "sta_gw");
+	json_writer_string(writer, gw);
+
+	return json_writer_end_object(writer);
+}
+
+uint32_t wifi_manager_get_sta_ip(){
+	return wifi_manager_sta_ip_addr;
+}
+
 
 bool wifi_manager_lock_json_buffer(TickType_t xTicksToWait){
 	if(wifi_manager_json_mutex){
@@ -541,8 +1489,119 @@ void wifi_manager_unlock_json_buffer(){
 	xSemaphoreGive( wifi_manager_json_mutex );
 }
 
-char* wifi_manager_get_ap_list_json(){
-	return accessp_json;
+/**
+ * @brief prints one access point of the JSON list.
+ */
+static void wifi_manager_write_ap_json(json_writer_t *writer, const wifi_ap_record_t *ap){
+	json_writer_begin_object(writer);
+	json_writer_key(writer, "ssid");
+	json_writer_string(writer, (char*)ap->ssid);
+	json_writer_key(writer, "chan");
+	json_writer_int(writer, ap->primary);
+	json_writer_key(writer, "rssi");
+	json_writer_int(writer, ap->rssi);
+	json_writer_key(writer, "auth");
+	json_writer_int(writer, ap->authmode);
+	json_writer_end_object(writer);
+}
+
+bool wifi_manager_get_ap_list_json(json_writer_t *writer){
+
+	/* the list is produced on demand from the scan records: no copy of it is ever kept in memory */
+	json_writer_begin_array(writer);
+
+	for(int i=0; i<ap_num;i++){
+		wifi_manager_write_ap_json(writer, &accessp_records[i]);
+	}
+
+	return json_writer_end_array(writer);
+}
+
+uint32_t wifi_manager_get_ap_list_generation(){
+	return ap_list_generation;
+}
+
+bool wifi_manager_get_ap_list_delta_json(json_writer_t *writer, uint32_t since){
+
+	/* a generation from before the oldest dropped tombstone, or from before a reboot, cannot be answered with a delta */
+	bool full = since < ap_list_delta_floor || since > ap_list_generation;
+
+	json_writer_begin_object(writer);
+	json_writer_key(writer, "gen");
+	json_writer_int(writer, (int32_t)ap_list_generation);
+	json_writer_key(writer, "full");
+	json_writer_bool(writer, full);
+
+	if(full){
+		json_writer_key(writer, "aps");
+		wifi_manager_get_ap_list_json(writer);
+		return json_writer_end_object(writer);
+	}
+
+	json_writer_key(writer, "removed");
+	json_writer_begin_array(writer);
+	for(int i=0; i<WIFI_MANAGER_AP_TOMBSTONE_NUM; i++){
+		ap_list_tombstone_t *t = &ap_list_tombstones[i];
+		if(t->removed > since){
+			json_writer_begin_object(writer);
+			json_writer_key(writer, "ssid");
+			json_writer_string(writer, (char*)t->ssid);
+			json_writer_key(writer, "auth");
+			json_writer_int(writer, t->authmode);
+			json_writer_end_object(writer);
+		}
+	}
+	json_writer_end_array(writer);
+
+	json_writer_key(writer, "added");
+	json_writer_begin_array(writer);
+	for(int i=0; i<ap_num; i++){
+		if(ap_list_state[i].added > since){
+			wifi_manager_write_ap_json(writer, &accessp_records[i]);
+		}
+	}
+	json_writer_end_array(writer);
+
+	json_writer_key(writer, "updated");
+	json_writer_begin_array(writer);
+	for(int i=0; i<ap_num; i++){
+		if(ap_list_state[i].added <= since && ap_list_state[i].updated > since){
+			wifi_manager_write_ap_json(writer, &accessp_records[i]);
+		}
+	}
+	json_writer_end_array(writer);
+
+	return json_writer_end_object(writer);
+}
+
+size_t wifi_manager_get_ap_list_bin_header(uint8_t *buf){
+	buf[0] = 'W';
+	buf[1] = 'M';
+	buf[2] = AP_LIST_BIN_VERSION;
+	buf[3] = (uint8_t)ap_num;
+	return AP_LIST_BIN_HEADER_SIZE;
+}
+
+size_t wifi_manager_get_ap_list_bin_record(uint16_t index, uint8_t *buf){
+
+	if(index >= ap_num){
+		return 0;
+	}
+
+	wifi_ap_record_t *ap = &accessp_records[index];
+	size_t ssid_len = strnlen((char*)ap->ssid, MAX_SSID_SIZE);
+	uint8_t *p = buf;
+
+	*p++ = (uint8_t)ssid_len;
+	memcpy(p, ap->ssid, ssid_len);
+	p += ssid_len;
+	memcpy(p, ap->bssid, 6);
+	p += 6;
+	*p++ = ap->primary;
+	*p++ = (uint8_t)ap->rssi;
+	*p++ = (uint8_t)ap->authmode;
+
+	return (size_t)(p - buf);
 }
 
 
@@ -576,10 +1635,7 @@ static void wifi_manager_event_handler(void* arg, esp_event_base_t event_base, i
 		 */
 		case WIFI_EVENT_SCAN_DONE:
 			ESP_LOGD(TAG, "WIFI_EVENT_SCAN_DONE");
-	    	xEventGroupClearBits(wifi_manager_event_group, WIFI_MANAGER_SCAN_BIT);
-			wifi_event_sta_scan_done_t* event_sta_scan_done = (wifi_event_sta_scan_done_t*)malloc(sizeof(wifi_event_sta_scan_done_t));
-			*event_sta_scan_done = *((wifi_event_sta_scan_done_t*)event_data);
-	    	wifi_manager_send_message(WM_EVENT_SCAN_DONE, event_sta_scan_done);
+	    	wifi_manager_send_event(WM_EVENT_SCAN_DONE, event_data, sizeof(wifi_event_sta_scan_done_t));
 			break;
 
 		/* If esp_wifi_start() returns ESP_OK and the current Wi-Fi mode is Station or AP+Station, then this event will
@@ -604,6 +1660,7 @@ static void wifi_manager_event_handler(void* arg, esp_event_base_t event_base, i
 		 * the application is LwIP-based, then you need to wait until the got ip event comes in. */
 		case WIFI_EVENT_STA_CONNECTED:
 			ESP_LOGI(TAG, "WIFI_EVENT_STA_CONNECTED");
+			diag_mark(DIAG_MARK_STA_CONNECTED);
 			break;
 
 		/* This event can be generated in the following scenarios:
@@ -652,15 +1709,13 @@ static void wifi_manager_event_handler(void* arg, esp_event_base_t event_base, i
 		 * IP changed” via LwIP menuconfig.*/
 		case WIFI_EVENT_STA_DISCONNECTED:
 			ESP_LOGI(TAG, "WIFI_EVENT_STA_DISCONNECTED");
-
-			wifi_event_sta_disconnected_t* wifi_event_sta_disconnected = (wifi_event_sta_disconnected_t*)malloc(sizeof(wifi_event_sta_disconnected_t));
-			*wifi_event_sta_disconnected =  *( (wifi_event_sta_disconnected_t*)event_data );
+			diag_mark(DIAG_MARK_STA_DISCONNECTED);
 
 			/* if a DISCONNECT message is posted while a scan is in progress this scan will NEVER end, causing scan to never work again. For this reason SCAN_BIT is cleared too */
 			xEventGroupClearBits(wifi_manager_event_group, WIFI_MANAGER_WIFI_CONNECTED_BIT | WIFI_MANAGER_SCAN_BIT);
 
 			/* post disconnect event with reason code */
-			wifi_manager_send_message(WM_EVENT_STA_DISCONNECTED, (void*)wifi_event_sta_disconnected );
+			wifi_manager_send_event(WM_EVENT_STA_DISCONNECTED, event_data, sizeof(wifi_event_sta_disconnected_t));
 			break;
 
 		/* This event arises when the AP to which the station is connected changes its authentication mode, e.g., from no auth
@@ -722,10 +1777,9 @@ static void wifi_manager_event_handler(void* arg, esp_event_base_t event_base, i
 		 * the application when the IPV4 changes to a valid one. */
 		case IP_EVENT_STA_GOT_IP:
 			ESP_LOGI(TAG, "IP_EVENT_STA_GOT_IP");
+			diag_mark(DIAG_MARK_STA_GOT_IP);
 	        xEventGroupSetBits(wifi_manager_event_group, WIFI_MANAGER_WIFI_CONNECTED_BIT);
-	        ip_event_got_ip_t* ip_event_got_ip = (ip_event_got_ip_t*)malloc(sizeof(ip_event_got_ip_t));
-			*ip_event_got_ip =  *( (ip_event_got_ip_t*)event_data );
-	        wifi_manager_send_message(WM_EVENT_STA_GOT_IP, (void*)(ip_event_got_ip) );
+	        wifi_manager_send_event(WM_EVENT_STA_GOT_IP, event_data, sizeof(ip_event_got_ip_t));
 			break;
 
 		/* This event arises when the IPV6 SLAAC support auto-configures an address for the ESP32, or when this address changes.
@@ -734,26 +1788,194 @@ static void wifi_manager_event_handler(void* arg, esp_event_base_t event_base, i
 			ESP_LOGI(TAG, "IP_EVENT_GOT_IP6");
 			break;
 
-		/* This event arises when the IPV4 address become invalid.
-		 * IP_STA_LOST_IP doesn’t arise immediately after the WiFi disconnects, instead it starts an IPV4 address lost timer,
-		 * if the IPV4 address is got before ip lost timer expires, IP_EVENT_STA_LOST_IP doesn’t happen. Otherwise, the event
-		 * arises when IPV4 address lost timer expires.
-		 * Generally the application don’t need to care about this event, it is just a debug event to let the application
-		 * know that the IPV4 address is lost. */
-		case IP_EVENT_STA_LOST_IP:
-			ESP_LOGI(TAG, "IP_EVENT_STA_LOST_IP");
-			break;
+		/* This event arises when the IPV4 address become invalid.
+		 * IP_STA_LOST_IP doesn’t arise immediately after the WiFi disconnects, instead it starts an IPV4 address lost timer,
+		 * if the IPV4 address is got before ip lost timer expires, IP_EVENT_STA_LOST_IP doesn’t happen. Otherwise, the event
+		 * arises when IPV4 address lost timer expires.
+		 * Generally the application don’t need to care about this event, it is just a debug event to let the application
+		 * know that the IPV4 address is lost. */
+		case IP_EVENT_STA_LOST_IP:
+			ESP_LOGI(TAG, "IP_EVENT_STA_LOST_IP");
+			break;
+
+		}
+	}
+
+}
+
+
+/**
+ * @brief Applies the IP configuration of the STA interface before a connection attempt.
+ *
+ * With a static IP there is no DHCP exchange at all: esp_netif raises IP_EVENT_STA_GOT_IP as soon as the link is up.
+ * The gateway is used as DNS server since a static configuration does not carry one.
+ */
+static void wifi_manager_apply_sta_ip_config(){
+
+	if(wifi_settings.sta_static_ip && wifi_settings.sta_static_ip_config.ip.addr != 0){
+
+		/* DHCP client must be stopped before setting new IP information. */
+		esp_netif_dhcpc_stop(esp_netif_sta);
+		if(esp_netif_set_ip_info(esp_netif_sta, &wifi_settings.sta_static_ip_config) != ESP_OK){
+			ESP_LOGE(TAG, "Could not apply static IP, falling back to DHCP");
+			esp_netif_dhcpc_start(esp_netif_sta);
+			return;
+		}
+
+		esp_netif_dns_info_t dns;
+		memset(&dns, 0x00, sizeof(dns));
+		dns.ip.u_addr.ip4.addr = wifi_settings.sta_static_ip_config.gw.addr;
+		dns.ip.type = IPADDR_TYPE_V4;
+		esp_netif_set_dns_info(esp_netif_sta, ESP_NETIF_DNS_MAIN, &dns);
+	}
+	else{
+		/* no-op if the DHCP client is already running */
+		esp_netif_dhcpc_start(esp_netif_sta);
+	}
+}
+
+
+wifi_config_t* wifi_manager_get_wifi_sta_config(){
+	return wifi_manager_config_sta;
+}
+
+
+/**
+ * @brief changes the status of a connection request, if it is still remembered.
+ */
+static void wifi_manager_set_connect_status(uint32_t id, wifi_manager_connect_status_t status){
+
+	portENTER_CRITICAL(&wifi_manager_connect_mux);
+	for(int i=0; i<WIFI_MANAGER_CONNECT_HISTORY_NUM; i++){
+		if(wifi_manager_connect_history[i].id == id){
+			wifi_manager_connect_history[i].status = status;
+			break;
+		}
+	}
+	portEXIT_CRITICAL(&wifi_manager_connect_mux);
+}
+
+/**
+ * @brief makes a connection request the one being processed and applies it to the STA config. Must be called from the wifi_manager task.
+ */
+static void wifi_manager_connect_begin(wifi_manager_connect_request_t *request){
+
+	wifi_config_t *config = wifi_manager_get_wifi_sta_config();
+	memset(config, 0x00, sizeof(wifi_config_t));
+	memcpy(config->sta.ssid, request->ssid, MAX_SSID_SIZE);
+	memcpy(config->sta.password, request->password, MAX_PASSWORD_SIZE);
+	memset(request->password, 0x00, sizeof(request->password));
+	if(request->bssid_set){
+		config->sta.bssid_set = true;
+		memcpy(config->sta.bssid, request->bssid, sizeof(config->sta.bssid));
+	}
+
+	/* the IP config is applied with the STA config, and saved with the other settings once connected */
+	if(request->ip_set){
+		portENTER_CRITICAL(&wifi_manager_settings_mux);
+		wifi_settings.sta_static_ip = request->static_ip;
+		if(request->static_ip){
+			memcpy(&wifi_settings.sta_static_ip_config, &request->ip_info, sizeof(esp_netif_ip_info_t));
+		}
+		else{
+			memset(&wifi_settings.sta_static_ip_config, 0x00, sizeof(esp_netif_ip_info_t));
+		}
+		portEXIT_CRITICAL(&wifi_manager_settings_mux);
+	}
+
+	wifi_manager_connect_current = request->id;
+	wifi_manager_set_connect_status(request->id, WM_CONNECT_CONNECTING);
+
+	/* in order to avoid a false positive on the front end app we need to quickly flush the ip json:
+	 * it could show the outcome of a previous connection */
+	if(wifi_manager_lock_json_buffer( portMAX_DELAY )){
+		wifi_manager_clear_ip_info_json();
+		wifi_manager_unlock_json_buffer();
+	}
+}
+
+/**
+ * @brief gives its outcome to the connection request being processed, if any. Must be called from the wifi_manager task.
+ */
+static void wifi_manager_connect_end(wifi_manager_connect_status_t status){
+
+	if(wifi_manager_connect_current){
+		wifi_manager_set_connect_status(wifi_manager_connect_current, status);
+		wifi_manager_connect_current = 0;
+	}
+}
+
+uint32_t wifi_manager_request_connect(const char *ssid, size_t ssid_len, const char *password, size_t password_len){
+
+	wifi_manager_connect_request_t request;
+	uint32_t id;
+
+	if(ssid_len > MAX_SSID_SIZE || password_len > MAX_PASSWORD_SIZE){
+		return 0;
+	}
 
-		}
+	memset(&request, 0x00, sizeof(request));
+	memcpy(request.ssid, ssid, ssid_len);
+	memcpy(request.password, password, password_len);
+	id = wifi_manager_submit_connect_request(&request);
+	memset(request.password, 0x00, sizeof(request.password));
+
+	return id;
+}
+
+uint32_t wifi_manager_submit_connect_request(const wifi_manager_connect_request_t *request){
+
+	queue_message msg;
+	uint32_t id;
+
+	msg.code = WM_ORDER_CONNECT_STA;
+	msg.param = (void*)CONNECTION_REQUEST_USER;
+	memset(&msg.event, 0x00, sizeof(msg.event));
+	memcpy(&msg.event.connect, request, sizeof(wifi_manager_connect_request_t));
+	msg.event.connect.ssid[MAX_SSID_SIZE] = '\0';
+	msg.event.connect.password[MAX_PASSWORD_SIZE] = '\0';
+
+	/* the request is remembered before it is posted: its status can be asked for as soon as the id is known */
+	portENTER_CRITICAL(&wifi_manager_connect_mux);
+	if(++wifi_manager_connect_last_id == 0){
+		wifi_manager_connect_last_id = 1;
+	}
+	id = wifi_manager_connect_last_id;
+	wifi_manager_connect_history[wifi_manager_connect_history_next].id = id;
+	wifi_manager_connect_history[wifi_manager_connect_history_next].status = WM_CONNECT_PENDING;
+	wifi_manager_connect_history_next = (wifi_manager_connect_history_next + 1) % WIFI_MANAGER_CONNECT_HISTORY_NUM;
+	portEXIT_CRITICAL(&wifi_manager_connect_mux);
+	msg.event.connect.id = id;
+
+	/* never wait for room in the queue: the caller may be the http server */
+	if(xQueueSend( wifi_manager_queue, &msg, 0) != pdPASS){
+		wifi_manager_set_connect_status(id, WM_CONNECT_UNKNOWN);
+		id = 0;
 	}
 
+	memset(msg.event.connect.password, 0x00, sizeof(msg.event.connect.password));
+	return id;
 }
 
+wifi_manager_connect_status_t wifi_manager_get_connect_status(uint32_t id){
 
-wifi_config_t* wifi_manager_get_wifi_sta_config(){
-	return wifi_manager_config_sta;
+	wifi_manager_connect_status_t status = WM_CONNECT_UNKNOWN;
+
+	portENTER_CRITICAL(&wifi_manager_connect_mux);
+	for(int i=0; i<WIFI_MANAGER_CONNECT_HISTORY_NUM; i++){
+		if(id != 0 && wifi_manager_connect_history[i].id == id){
+			status = wifi_manager_connect_history[i].status;
+			break;
+		}
+	}
+	portEXIT_CRITICAL(&wifi_manager_connect_mux);
+
+	return status;
 }
 
+const char* wifi_manager_get_connect_status_name(wifi_manager_connect_status_t status){
+	return status <= WM_CONNECT_SUPERSEDED ? wifi_manager_connect_status_names[status] : "";
+}
 
 void wifi_manager_connect_async(){
 	/* in order to avoid a false positive on the front end app we need to quickly flush the ip json
@@ -775,23 +1997,32 @@ char* wifi_manager_get_ip_info_json(){
 
 void wifi_manager_destroy(){
 
+	diag_unregister_task(DIAG_TASK_WIFI_MANAGER);
 	vTaskDelete(task_wifi_manager);
 	task_wifi_manager = NULL;
 
 	/* heap buffers */
-	free(accessp_records);
+	diag_free(DIAG_HEAP_SCAN, accessp_records);
 	accessp_records = NULL;
-	free(accessp_json);
-	accessp_json = NULL;
-	free(ip_info_json);
+	diag_free(DIAG_HEAP_SCAN, ap_list_state);
+	ap_list_state = NULL;
+	diag_free(DIAG_HEAP_SCAN, wifi_manager_roaming_candidates);
+	wifi_manager_roaming_candidates = NULL;
+	ap_list_state_num = 0;
+	diag_free(DIAG_HEAP_JSON, ip_info_json);
 	ip_info_json = NULL;
-	free(wifi_manager_sta_ip);
+	diag_free(DIAG_HEAP_WIFI_MANAGER, wifi_manager_sta_ip);
 	wifi_manager_sta_ip = NULL;
 	if(wifi_manager_config_sta){
-		free(wifi_manager_config_sta);
+		diag_free(DIAG_HEAP_WIFI_MANAGER, wifi_manager_config_sta);
 		wifi_manager_config_sta = NULL;
 	}
 
+	if(wifi_manager_mdns_started){
+		mdns_free();
+		wifi_manager_mdns_started = false;
+	}
+
 	/* RTOS objects */
 	vSemaphoreDelete(wifi_manager_json_mutex);
 	wifi_manager_json_mutex = NULL;
@@ -802,6 +2033,18 @@ void wifi_manager_destroy(){
 	vQueueDelete(wifi_manager_queue);
 	wifi_manager_queue = NULL;
 
+	/* subscribers */
+	if(task_wifi_manager_events){
+		diag_unregister_task(DIAG_TASK_EVENTS);
+		vTaskDelete(task_wifi_manager_events);
+		task_wifi_manager_events = NULL;
+	}
+	if(wifi_manager_event_queue){
+		vQueueDelete(wifi_manager_event_queue);
+		wifi_manager_event_queue = NULL;
+	}
+	wifi_manager_event_task_state = WM_EVENT_TASK_NONE;
+	memset(wifi_manager_subscribers, 0x00, sizeof(wifi_manager_subscribers));
 
 }
 
@@ -862,6 +2105,7 @@ BaseType_t wifi_manager_send_message_to_front(message_code_t code, void *param){
 	queue_message msg;
 	msg.code = code;
 	msg.param = param;
+	memset(&msg.event, 0x00, sizeof(msg.event));
 	return xQueueSendToFront( wifi_manager_queue, &msg, portMAX_DELAY);
 }
 
@@ -869,15 +2113,354 @@ BaseType_t wifi_manager_send_message(message_code_t code, void *param){
 	queue_message msg;
 	msg.code = code;
 	msg.param = param;
+	memset(&msg.event, 0x00, sizeof(msg.event));
+	return xQueueSend( wifi_manager_queue, &msg, portMAX_DELAY);
+}
+
+BaseType_t wifi_manager_send_event(message_code_t code, const void *event_data, size_t size){
+	queue_message msg;
+	msg.code = code;
+	msg.param = NULL;
+	if(size > sizeof(msg.event)) size = sizeof(msg.event);
+	memset(&msg.event, 0x00, sizeof(msg.event));
+	memcpy(&msg.event, event_data, size);
 	return xQueueSend( wifi_manager_queue, &msg, portMAX_DELAY);
 }
 
 
+/**
+ * @brief adds the time a subscriber took to handle a message to its report.
+ */
+static void wifi_manager_record_subscriber(uint8_t i, uint32_t generation, uint32_t us, uint32_t wait_us){
+
+	wifi_manager_subscriber_t *subscriber = &wifi_manager_subscribers[i];
+
+	portENTER_CRITICAL(&wifi_manager_subscribers_mux);
+	/* the slot may have been given to another subscriber during the call */
+	if(subscriber->func_ptr != NULL && subscriber->generation == generation){
+		subscriber->calls++;
+		subscriber->last_us = us;
+		subscriber->total_us += us;
+		if(us > subscriber->max_us){
+			subscriber->max_us = us;
+		}
+		if(wait_us > subscriber->max_wait_us){
+			subscriber->max_wait_us = wait_us;
+		}
+	}
+	portEXIT_CRITICAL(&wifi_manager_subscribers_mux);
+}
+
+/**
+ * @brief delivers a message to its subscribers. Synchronous subscribers are called in turn, deferred subscribers get a copy
+ * of the event data through the queue of the wifi_manager_events task. Must be called from the wifi_manager task.
+ * @param param the parameter of the subscribers: NULL, or the event data of the message.
+ */
+static void wifi_manager_publish(const queue_message *msg, void *param){
+
+	wifi_manager_deferred_event_t deferred;
+	void (*func_ptr)(void*);
+	wifi_manager_delivery_t delivery;
+	uint32_t generation;
+	bool prepared = false;
+
+	for(uint8_t i=0; i<WIFI_MANAGER_MAX_SUBSCRIBERS; i++){
+
+		portENTER_CRITICAL(&wifi_manager_subscribers_mux);
+		func_ptr = wifi_manager_subscribers[i].code == msg->code ? wifi_manager_subscribers[i].func_ptr : NULL;
+		delivery = wifi_manager_subscribers[i].delivery;
+		generation = wifi_manager_subscribers[i].generation;
+		portEXIT_CRITICAL(&wifi_manager_subscribers_mux);
+
+		if(func_ptr == NULL){
+			continue;
+		}
+
+		if(delivery == WM_DELIVERY_SYNC){
+			int64_t start = esp_timer_get_time();
+			(*func_ptr)(param);
+			uint32_t us = (uint32_t)(esp_timer_get_time() - start);
+
+			wifi_manager_record_subscriber(i, generation, us, 0);
+			if(us > WIFI_MANAGER_SLOW_SUBSCRIBER_MS * 1000){
+				ESP_LOGW(TAG, "subscriber %p held message %d for %u ms", func_ptr, msg->code, (unsigned)(us / 1000));
+			}
+		}
+		else{
+			if(!prepared){
+				/* only the event data the parameter points to is copied: orders can carry credentials that must not leave the task */
+				uintptr_t event = (uintptr_t)&msg->event;
+				memset(&deferred, 0x00, sizeof(deferred));
+				deferred.code = msg->code;
+				deferred.time = esp_timer_get_time();
+				if((uintptr_t)param >= event && (uintptr_t)param < event + sizeof(msg->event)){
+					deferred.param_offset = (int32_t)((uintptr_t)param - event);
+					memcpy(&deferred.event, &msg->event, sizeof(deferred.event));
+				}
+				else{
+					deferred.param_offset = -1;
+					deferred.param = param;
+				}
+				prepared = true;
+			}
+			deferred.subscriber = i;
+			deferred.generation = generation;
+			deferred.func_ptr = func_ptr;
+
+			/* never wait for room in the queue: a deferred subscriber misses messages instead of slowing the wifi manager down */
+			if(xQueueSend( wifi_manager_event_queue, &deferred, 0) != pdPASS){
+				portENTER_CRITICAL(&wifi_manager_subscribers_mux);
+				if(wifi_manager_subscribers[i].func_ptr != NULL && wifi_manager_subscribers[i].generation == generation){
+					wifi_manager_subscribers[i].dropped++;
+				}
+				portEXIT_CRITICAL(&wifi_manager_subscribers_mux);
+			}
+		}
+	}
+}
+
+/**
+ * @brief task running the deferred subscribers, one message at a time.
+ */
+static void wifi_manager_events(void *pvParameters){
+
+	wifi_manager_deferred_event_t deferred;
+
+	for(;;){
+		if(xQueueReceive( wifi_manager_event_queue, &deferred, portMAX_DELAY ) == pdPASS){
+
+			bool subscribed;
+			void *param = deferred.param_offset >= 0 ? (void*)((char*)&deferred.event + deferred.param_offset) : deferred.param;
+
+			/* unsubscribed while the message was waiting, possibly with the slot given to another subscriber since */
+			portENTER_CRITICAL(&wifi_manager_subscribers_mux);
+			subscribed = wifi_manager_subscribers[deferred.subscriber].func_ptr != NULL &&
+					wifi_manager_subscribers[deferred.subscriber].generation == deferred.generation;
+			portEXIT_CRITICAL(&wifi_manager_subscribers_mux);
+
+			if(subscribed){
+				int64_t start = esp_timer_get_time();
+				(*deferred.func_ptr)(param);
+				int64_t end = esp_timer_get_time();
+
+				wifi_manager_record_subscriber(deferred.subscriber, deferred.generation, (uint32_t)(end - start), (uint32_t)(start - deferred.time));
+			}
+		}
+	}
+
+	vTaskDelete( NULL );
+}
+
+/**
+ * @brief frees a subscriber slot. Must be called with wifi_manager_subscribers_mux held.
+ */
+static void wifi_manager_clear_subscriber(int i){
+
+	uint32_t generation = wifi_manager_subscribers[i].generation;
+
+	memset(&wifi_manager_subscribers[i], 0x00, sizeof(wifi_manager_subscriber_t));
+	wifi_manager_subscribers[i].generation = generation + 1;
+}
+
+/**
+ * @brief creates the wifi_manager_events task and its queue if they do not exist yet. A caller arriving while another one
+ * creates them waits for the outcome.
+ * @return true if the task is running.
+ */
+static bool wifi_manager_start_event_task(){
+
+	wifi_manager_event_task_state_t state;
+
+	portENTER_CRITICAL(&wifi_manager_subscribers_mux);
+	state = wifi_manager_event_task_state;
+	if(state == WM_EVENT_TASK_NONE){
+		wifi_manager_event_task_state = WM_EVENT_TASK_CREATING;
+	}
+	portEXIT_CRITICAL(&wifi_manager_subscribers_mux);
+
+	if(state == WM_EVENT_TASK_NONE){
+
+		wifi_manager_event_queue = xQueueCreate( WIFI_MANAGER_EVENT_QUEUE_SIZE, sizeof(wifi_manager_deferred_event_t) );
+		if(wifi_manager_event_queue != NULL &&
+			xTaskCreate(&wifi_manager_events, "wm_events", WIFI_MANAGER_EVENT_TASK_STACK_SIZE, NULL, WIFI_MANAGER_TASK_PRIORITY-1, &task_wifi_manager_events) == pdPASS){
+			diag_register_task(DIAG_TASK_EVENTS, task_wifi_manager_events, WIFI_MANAGER_EVENT_TASK_STACK_SIZE);
+			state = WM_EVENT_TASK_READY;
+		}
+		else if(wifi_manager_event_queue != NULL){
+			vQueueDelete(wifi_manager_event_queue);
+			wifi_manager_event_queue = NULL;
+		}
+
+		portENTER_CRITICAL(&wifi_manager_subscribers_mux);
+		wifi_manager_event_task_state = state;
+		portEXIT_CRITICAL(&wifi_manager_subscribers_mux);
+	}
+
+	while(state == WM_EVENT_TASK_CREATING){
+		vTaskDelay(1);
+		portENTER_CRITICAL(&wifi_manager_subscribers_mux);
+		state = wifi_manager_event_task_state;
+		portEXIT_CRITICAL(&wifi_manager_subscribers_mux);
+	}
+
+	return state == WM_EVENT_TASK_READY;
+}
+
+/**
+ * @brief takes a free subscriber slot. The task of the deferred subscribers is started with the first of them.
+ */
+static uint32_t wifi_manager_add_subscriber(message_code_t message_code, void (*func_ptr)(void*), wifi_manager_delivery_t delivery, bool callback){
+
+	uint32_t id = 0;
+
+	if(message_code <= NONE || message_code >= WM_MESSAGE_CODE_COUNT || func_ptr == NULL){
+		return 0;
+	}
+
+	if(delivery == WM_DELIVERY_DEFERRED && !wifi_manager_start_event_task()){
+		return 0;
+	}
+
+	portENTER_CRITICAL(&wifi_manager_subscribers_mux);
+	for(int i=0; i<WIFI_MANAGER_MAX_SUBSCRIBERS; i++){
+		wifi_manager_subscriber_t *subscriber = &wifi_manager_subscribers[i];
+		if(subscriber->func_ptr == NULL){
+			subscriber->code = message_code;
+			subscriber->func_ptr = func_ptr;
+			subscriber->delivery = delivery;
+			subscriber->callback = callback;
+			id = i + 1;
+			break;
+		}
+	}
+	portEXIT_CRITICAL(&wifi_manager_subscribers_mux);
+
+	if(id == 0){
+		ESP_LOGE(TAG, "no room left for a subscriber to message %d", message_code);
+	}
+
+	return id;
+}
+
 void wifi_manager_set_callback(message_code_t message_code, void (*func_ptr)(void*) ){
 
-	if(cb_ptr_arr && message_code < WM_MESSAGE_CODE_COUNT){
-		cb_ptr_arr[message_code] = func_ptr;
+	/* the callback replaces the previous one of the message code */
+	portENTER_CRITICAL(&wifi_manager_subscribers_mux);
+	for(int i=0; i<WIFI_MANAGER_MAX_SUBSCRIBERS; i++){
+		if(wifi_manager_subscribers[i].callback && wifi_manager_subscribers[i].code == message_code){
+			wifi_manager_clear_subscriber(i);
+		}
+	}
+	portEXIT_CRITICAL(&wifi_manager_subscribers_mux);
+
+	if(func_ptr){
+		wifi_manager_add_subscriber(message_code, func_ptr, WM_DELIVERY_SYNC, true);
+	}
+}
+
+uint32_t wifi_manager_subscribe(message_code_t message_code, void (*func_ptr)(void*), wifi_manager_delivery_t delivery){
+	return wifi_manager_add_subscriber(message_code, func_ptr, delivery, false);
+}
+
+void wifi_manager_unsubscribe(uint32_t id){
+
+	if(id == 0 || id > WIFI_MANAGER_MAX_SUBSCRIBERS){
+		return;
+	}
+
+	portENTER_CRITICAL(&wifi_manager_subscribers_mux);
+	wifi_manager_clear_subscriber(id - 1);
+	portEXIT_CRITICAL(&wifi_manager_subscribers_mux);
+}
+
+/**
+ * @brief fills the report of one subscriber slot. Must be called with wifi_manager_subscribers_mux held.
+ * @return false if the slot is free.
+ */
+static bool wifi_manager_fill_subscriber_report(int i, wifi_manager_subscriber_report_t *report){
+
+	const wifi_manager_subscriber_t *subscriber = &wifi_manager_subscribers[i];
+
+	if(subscriber->func_ptr == NULL){
+		return false;
+	}
+
+	report->id = i + 1;
+	report->code = subscriber->code;
+	report->func_ptr = subscriber->func_ptr;
+	report->delivery = subscriber->delivery;
+	report->calls = subscriber->calls;
+	report->dropped = subscriber->dropped;
+	report->last_us = subscriber->last_us;
+	report->max_us = subscriber->max_us;
+	report->avg_us = subscriber->calls ? (uint32_t)(subscriber->total_us / subscriber->calls) : 0;
+	report->max_wait_us = subscriber->max_wait_us;
+
+	return true;
+}
+
+uint8_t wifi_manager_get_subscriber_report(wifi_manager_subscriber_report_t *report, uint8_t size){
+
+	uint8_t count = 0;
+
+	portENTER_CRITICAL(&wifi_manager_subscribers_mux);
+	for(int i=0; i<WIFI_MANAGER_MAX_SUBSCRIBERS && count < size; i++){
+		if(wifi_manager_fill_subscriber_report(i, &report[count])){
+			count++;
+		}
+	}
+	portEXIT_CRITICAL(&wifi_manager_subscribers_mux);
+
+	return count;
+}
+
+bool wifi_manager_get_subscribers_json(json_writer_t *writer){
+
+	wifi_manager_subscriber_report_t report;
+	char func[11];
+
+	json_writer_begin_object(writer);
+	json_writer_key(writer, "subscribers");
+	json_writer_begin_array(writer);
+	for(int i=0; i<WIFI_MANAGER_MAX_SUBSCRIBERS; i++){
+
+		/* one at a time: the report of all subscribers is not held on the stack of the http server */
+		portENTER_CRITICAL(&wifi_manager_subscribers_mux);
+		bool found = wifi_manager_fill_subscriber_report(i, &report);
+		portEXIT_CRITICAL(&wifi_manager_subscribers_mux);
+		if(!found){
+			continue;
+		}
+
+		/* the address of the function can be looked up with addr2line */
+		snprintf(func, sizeof(func), "0x%08x", (unsigned)(uintptr_t)report.func_ptr);
+
+		json_writer_begin_object(writer);
+		json_writer_key(writer, "id");
+		json_writer_int(writer, (int32_t)report.id);
+		json_writer_key(writer, "code");
+		json_writer_int(writer, report.code);
+		json_writer_key(writer, "func");
+		json_writer_string(writer, func);
+		json_writer_key(writer, "delivery");
+		json_writer_string(writer, report.delivery == WM_DELIVERY_DEFERRED ? "deferred" : "sync");
+		json_writer_key(writer, "calls");
+		json_writer_int(writer, (int32_t)report.calls);
+		json_writer_key(writer, "dropped");
+		json_writer_int(writer, (int32_t)report.dropped);
+		json_writer_key(writer, "last_us");
+		json_writer_int(writer, (int32_t)report.last_us);
+		json_writer_key(writer, "avg_us");
+		json_writer_int(writer, (int32_t)report.avg_us);
+		json_writer_key(writer, "max_us");
+		json_writer_int(writer, (int32_t)report.max_us);
+		json_writer_key(writer, "max_wait_us");
+		json_writer_int(writer, (int32_t)report.max_wait_us);
+		json_writer_end_object(writer);
 	}
+	json_writer_end_array(writer);
+
+	return json_writer_end_object(writer);
 }
 
 esp_netif_t* wifi_manager_get_esp_netif_ap(){
@@ -929,18 +2512,7 @@ void wifi_manager( void * pvParameters ){
 			.beacon_interval = DEFAULT_AP_BEACON_INTERVAL,
 		},
 	};
-	memcpy(ap_config.ap.ssid, wifi_settings.ap_ssid , sizeof(wifi_settings.ap_ssid));
-
-	/* if the password lenght is under 8 char which is the minium for WPA2, the access point starts as open */
-	if(strlen( (char*)wifi_settings.ap_pwd) < WPA2_MINIMUM_PASSWORD_LENGTH){
-		ap_config.ap.authmode = WIFI_AUTH_OPEN;
-		memset( ap_config.ap.password, 0x00, sizeof(ap_config.ap.password) );
-	}
-	else{
-		ap_config.ap.authmode = WIFI_AUTH_WPA2_PSK;
-		memcpy(ap_config.ap.password, wifi_settings.ap_pwd, sizeof(wifi_settings.ap_pwd));
-	}
-	
+	wifi_manager_set_ap_credentials(&ap_config);
 
 	/* DHCP AP configuration */
 	esp_netif_dhcps_stop(esp_netif_ap); /* DHCP client/server must be stopped before setting new IP information. */
@@ -955,23 +2527,18 @@ void wifi_manager( void * pvParameters ){
 	ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_APSTA));
 	ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_AP, &ap_config));
 	ESP_ERROR_CHECK(esp_wifi_set_bandwidth(WIFI_IF_AP, wifi_settings.ap_bandwidth));
-	ESP_ERROR_CHECK(esp_wifi_set_ps(wifi_settings.sta_power_save));
+	wifi_manager_apply_power_profile(wifi_manager_power_profile_from_ps(wifi_settings.sta_power_save));
 
 
 	/* by default the mode is STA because wifi_manager will not start the access point unless it has to! */
 	ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
 	ESP_ERROR_CHECK(esp_wifi_start());
 
-	/* start http server */
-	http_app_start(false);
-
-	/* wifi scanner config */
-	wifi_scan_config_t scan_config = {
-		.ssid = 0,
-		.bssid = 0,
-		.channel = 0,
-		.show_hidden = true
-	};
+	/* start http server. In lazy start mode it is only brought up with the access point or when explicitly
+	 * ordered, so that restoring a saved connection at boot isn't slowed down by a server nobody will reach */
+	if(!WIFI_MANAGER_LAZY_START){
+		http_app_start(false);
+	}
 
 	/* enqueue first event: load previous config */
 	wifi_manager_send_message(WM_ORDER_LOAD_AND_RESTORE_STA, NULL);
@@ -985,49 +2552,101 @@ void wifi_manager( void * pvParameters ){
 			switch(msg.code){
 
 			case WM_EVENT_SCAN_DONE:{
-				wifi_event_sta_scan_done_t *evt_scan_done = (wifi_event_sta_scan_done_t*)msg.param;
-				/* only check for AP if the scan is succesful */
-				if(evt_scan_done->status == 0){
+				wifi_event_sta_scan_done_t *evt_scan_done = &msg.event.scan_done;
+				/* only check for AP if the scan is succesful. The records of a cancelled roaming scan are left out */
+				if(evt_scan_done->status == 0 && !wifi_manager_roaming_discard){
 					/* As input param, it stores max AP number ap_records can hold. As output param, it receives the actual AP number this API returns.
-					* As a consequence, ap_num MUST be reset to MAX_AP_NUM at every scan */
-					ap_num = MAX_AP_NUM;
-					ESP_ERROR_CHECK(esp_wifi_scan_get_ap_records(&ap_num, accessp_records));
+					* The records of each channel of a mask are added after the ones of the previous channels */
+					uint16_t num;
+					if(wifi_manager_roaming_scan){
+						/* a roaming scan only lists the current SSID: the access point list is left as it is */
+						num = WIFI_MANAGER_ROAMING_MAX_CANDIDATES - wifi_manager_scan_found;
+						if(esp_wifi_scan_get_ap_records(&num, wifi_manager_roaming_candidates + wifi_manager_scan_found) == ESP_OK){
+							wifi_manager_scan_found += num;
+						}
+					}
 					/* make sure the http server isn't trying to access the list while it gets refreshed */
-					if(wifi_manager_lock_json_buffer( pdMS_TO_TICKS(1000) )){
+					else if(wifi_manager_lock_json_buffer( pdMS_TO_TICKS(1000) )){
+						num = MAX_AP_NUM - wifi_manager_scan_found;
+						ESP_ERROR_CHECK(esp_wifi_scan_get_ap_records(&num, accessp_records + wifi_manager_scan_found));
+						ap_num = wifi_manager_scan_found + num;
 						/* Will remove the duplicate SSIDs from the list and update ap_num */
 						wifi_manager_filter_unique(accessp_records, &ap_num);
-						wifi_manager_generate_acess_points_json();
+						wifi_manager_scan_found = ap_num;
+						wifi_manager_scan_listed = true;
 						wifi_manager_unlock_json_buffer();
 					}
 					else{
 						ESP_LOGE(TAG, "could not get access to json mutex in wifi_scan");
 					}
+
+					/* carry on with the next channel of the mask: the scan is not done yet. A scan cancelled in the
+					 * meantime, by a disconnection or a connection order, has its scan bit cleared and is not resumed */
+					if(wifi_manager_scan_channels_left && (xEventGroupGetBits(wifi_manager_event_group) & WIFI_MANAGER_SCAN_BIT) &&
+						wifi_manager_scan_next() == ESP_OK){
+						break;
+					}
+				}
+				wifi_manager_scan_channels_left = 0;
+				xEventGroupClearBits(wifi_manager_event_group, WIFI_MANAGER_SCAN_BIT);
+
+				if(wifi_manager_roaming_discard){
+					wifi_manager_roaming_discard = false;
+				}
+				else if(wifi_manager_roaming_scan){
+					wifi_manager_roaming_scan = false;
+					wifi_manager_roaming_select(wifi_manager_roaming_candidates, wifi_manager_scan_found);
+				}
+				else{
+					diag_mark(DIAG_MARK_SCAN_DONE);
+
+					/* the list is published to delta clients once complete */
+					if(wifi_manager_scan_listed && wifi_manager_lock_json_buffer( pdMS_TO_TICKS(1000) )){
+						wifi_manager_update_ap_list_generation();
+						wifi_manager_unlock_json_buffer();
+					}
 				}
 
 				/* callback */
-				if(cb_ptr_arr[msg.code]) (*cb_ptr_arr[msg.code])( msg.param );
-				free(evt_scan_done);
+				wifi_manager_publish(&msg, evt_scan_done);
 				}
 				break;
 
 			case WM_ORDER_START_WIFI_SCAN:
 				ESP_LOGD(TAG, "MESSAGE: ORDER_START_WIFI_SCAN");
 
-				/* if a scan is already in progress this message is simply ignored thanks to the WIFI_MANAGER_SCAN_BIT uxBit */
+				/* if a scan is already in progress this message is simply ignored thanks to the WIFI_MANAGER_SCAN_BIT uxBit.
+				 * It is also ignored if the last scan is more recent than the scan interval of the power profile */
 				uxBits = xEventGroupGetBits(wifi_manager_event_group);
-				if(! (uxBits & WIFI_MANAGER_SCAN_BIT) ){
-					xEventGroupSetBits(wifi_manager_event_group, WIFI_MANAGER_SCAN_BIT);
-					ESP_ERROR_CHECK(esp_wifi_scan_start(&scan_config, false));
+				if(! (uxBits & WIFI_MANAGER_SCAN_BIT) &&
+					(!wifi_manager_scanned || xTaskGetTickCount() - wifi_manager_last_scan >= pdMS_TO_TICKS(wifi_manager_power_profiles[wifi_manager_power_profile].scan_interval_ms)) ){
+					diag_mark(DIAG_MARK_SCAN_ORDER);
+					wifi_manager_last_scan = xTaskGetTickCount();
+					wifi_manager_scanned = true;
+					/* without parameters, it is the full scan of the web app */
+					wifi_manager_scan_start(msg.param ? &msg.event.scan : &wifi_manager_scan_full, false);
 				}
 
 				/* callback */
-				if(cb_ptr_arr[msg.code]) (*cb_ptr_arr[msg.code])(NULL);
+				wifi_manager_publish(&msg, NULL);
 
 				break;
 
 			case WM_ORDER_LOAD_AND_RESTORE_STA:
 				ESP_LOGI(TAG, "MESSAGE: ORDER_LOAD_AND_RESTORE_STA");
-				if(wifi_manager_fetch_wifi_sta_config()){
+				bool saved = wifi_manager_fetch_wifi_sta_config();
+
+				/* the access point was configured before the saved settings were loaded */
+				wifi_manager_set_ap_credentials(&ap_config);
+				ap_config.ap.channel = wifi_settings.ap_channel;
+				wifi_manager_ap_config_pending = true;
+
+				/* the saved settings may come with another power profile */
+				if(wifi_manager_power_profile_from_ps(wifi_settings.sta_power_save) != wifi_manager_power_profile){
+					wifi_manager_apply_power_profile(wifi_manager_power_profile_from_ps(wifi_settings.sta_power_save));
+				}
+
+				if(saved){
 					ESP_LOGI(TAG, "Saved wifi found on startup. Will attempt to connect.");
 					wifi_manager_send_message(WM_ORDER_CONNECT_STA, (void*)CONNECTION_REQUEST_RESTORE_CONNECTION);
 				}
@@ -1038,7 +2657,7 @@ void wifi_manager( void * pvParameters ){
 				}
 
 				/* callback */
-				if(cb_ptr_arr[msg.code]) (*cb_ptr_arr[msg.code])(NULL);
+				wifi_manager_publish(&msg, NULL);
 
 				break;
 
@@ -1051,33 +2670,64 @@ void wifi_manager( void * pvParameters ){
 				 * */
 				if((BaseType_t)msg.param == CONNECTION_REQUEST_USER) {
 					xEventGroupSetBits(wifi_manager_event_group, WIFI_MANAGER_REQUEST_STA_CONNECT_BIT);
+
+					/* a request still in progress will never know its outcome */
+					wifi_manager_connect_end(WM_CONNECT_SUPERSEDED);
 				}
 				else if((BaseType_t)msg.param == CONNECTION_REQUEST_RESTORE_CONNECTION) {
 					xEventGroupSetBits(wifi_manager_event_group, WIFI_MANAGER_REQUEST_RESTORE_STA_BIT);
 				}
 
+				/* a connection order supersedes a handover */
+				wifi_manager_roaming_reset();
+
 				uxBits = xEventGroupGetBits(wifi_manager_event_group);
 				if( ! (uxBits & WIFI_MANAGER_WIFI_CONNECTED_BIT) ){
+					/* a connection request brings its own access point. Without one, the config is used as it is */
+					if(msg.event.connect.id){
+						wifi_manager_connect_begin(&msg.event.connect);
+					}
+
 					/* update config to latest and attempt connection */
+					wifi_manager_get_wifi_sta_config()->sta.listen_interval = wifi_manager_power_profiles[wifi_manager_power_profile].listen_interval;
+
+					/* an automatic reconnection looks for the access point on the channel it was last seen on first. The hint is used once
+					 * in case the access point moved to another channel. Other connections scan all channels */
+					if(!wifi_manager_get_wifi_sta_config()->sta.bssid_set){
+						wifi_manager_get_wifi_sta_config()->sta.channel = (BaseType_t)msg.param == CONNECTION_REQUEST_AUTO_RECONNECT ? wifi_manager_sta_channel : 0;
+						wifi_manager_sta_channel = 0;
+					}
 					ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, wifi_manager_get_wifi_sta_config()));
+					wifi_manager_apply_sta_ip_config();
 
-					/* if there is a wifi scan in progress abort it first
+					/* if there is a wifi scan in progress abort it first, including the channels of its mask not scanned yet
 					   Calling esp_wifi_scan_stop will trigger a SCAN_DONE event which will reset this bit */
 					if(uxBits & WIFI_MANAGER_SCAN_BIT){
+						wifi_manager_scan_cancel();
 						esp_wifi_scan_stop();
 					}
+					diag_mark(DIAG_MARK_CONNECT_ORDER);
 					ESP_ERROR_CHECK(esp_wifi_connect());
 				}
+				else if(msg.event.connect.id){
+					/* the STA has to be disconnected first: the request is dropped without touching the config in use */
+					ESP_LOGW(TAG, "Connection request %u dropped: already connected", (unsigned)msg.event.connect.id);
+					wifi_manager_set_connect_status(msg.event.connect.id, WM_CONNECT_FAILED);
+				}
 
 				/* callback */
-				if(cb_ptr_arr[msg.code]) (*cb_ptr_arr[msg.code])(NULL);
+				wifi_manager_publish(&msg, NULL);
 
 				break;
 
 			case WM_EVENT_STA_DISCONNECTED:
-				;wifi_event_sta_disconnected_t* wifi_event_sta_disconnected = (wifi_event_sta_disconnected_t*)msg.param;
+				;wifi_event_sta_disconnected_t* wifi_event_sta_disconnected = &msg.event.sta_disconnected;
 				ESP_LOGI(TAG, "MESSAGE: EVENT_STA_DISCONNECTED with Reason code: %d", wifi_event_sta_disconnected->reason);
 
+				/* the event handler cleared the scan bit: the channels of the mask not scanned yet are forgotten with it,
+				 * and so is a roaming scan */
+				wifi_manager_scan_cancel();
+
 				/* this even can be posted in numerous different conditions
 				 *
 				 * 1. SSID password is wrong
@@ -1138,6 +2788,11 @@ void wifi_manager( void * pvParameters ){
 					xTimerStop( wifi_manager_shutdown_ap_timer, (TickType_t)0 );
 				}
 
+				/* no signal to check until the next connection */
+				if(wifi_manager_roaming_timer){
+					xTimerStop( wifi_manager_roaming_timer, (TickType_t)0 );
+				}
+
 				uxBits = xEventGroupGetBits(wifi_manager_event_group);
 				if( uxBits & WIFI_MANAGER_REQUEST_STA_CONNECT_BIT ){
 					/* there are no retries when it's a user requested connection by design. This avoids a user hanging too much
@@ -1148,6 +2803,7 @@ void wifi_manager( void * pvParameters ){
 						wifi_manager_generate_ip_info_json( UPDATE_FAILED_ATTEMPT );
 						wifi_manager_unlock_json_buffer();
 					}
+					wifi_manager_connect_end(WM_CONNECT_FAILED);
 
 				}
 				else if (uxBits & WIFI_MANAGER_REQUEST_DISCONNECT_BIT){
@@ -1171,6 +2827,10 @@ void wifi_manager( void * pvParameters ){
 					/* start SoftAP */
 					wifi_manager_send_message(WM_ORDER_START_AP, NULL);
 				}
+				else if(wifi_manager_roaming_state != WM_ROAMING_IDLE && wifi_manager_roaming_disconnected()){
+					/* handover in progress: the STA is joining another access point of the same SSID */
+					ESP_LOGI(TAG, "Left the access point for the handover");
+				}
 				else{
 					/* lost connection ? */
 					if(wifi_manager_lock_json_buffer( portMAX_DELAY )){
@@ -1203,25 +2863,41 @@ void wifi_manager( void * pvParameters ){
 				}
 
 				/* callback */
-				if(cb_ptr_arr[msg.code]) (*cb_ptr_arr[msg.code])( msg.param );
-				free(wifi_event_sta_disconnected);
+				wifi_manager_publish(&msg, wifi_event_sta_disconnected);
 
 				break;
 
 			case WM_ORDER_START_AP:
 				ESP_LOGI(TAG, "MESSAGE: ORDER_START_AP");
 
+				uxBits = xEventGroupGetBits(wifi_manager_event_group);
 				ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_APSTA));
 
-				/* restart HTTP daemon */
-				http_app_stop();
+				/* settings changed while the access point was down */
+				if(wifi_manager_ap_config_pending){
+					wifi_manager_ap_config_pending = false;
+					ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_AP, &ap_config));
+					ESP_ERROR_CHECK(esp_wifi_set_bandwidth(WIFI_IF_AP, wifi_settings.ap_bandwidth));
+				}
+
+				/* place the access point where the STA will not drag it away. A running access point is not moved: its clients would be dropped */
+				if(WIFI_MANAGER_AP_AUTO_CHANNEL && !(uxBits & WIFI_MANAGER_AP_STARTED_BIT)){
+					wifi_manager_set_ap_channel(&ap_config, wifi_manager_pick_ap_channel());
+				}
+
+				/* start HTTP daemon, or switch the running one to purge sockets for captive portal clients.
+				 * The server is never restarted on AP transitions so that requests in flight are not dropped */
 				http_app_start(true);
+				http_app_set_captive_portal(true);
 
 				/* start DNS */
 				dns_server_start();
 
+				/* publish the portal on the access point */
+				wifi_manager_initialise_mdns();
+
 				/* callback */
-				if(cb_ptr_arr[msg.code]) (*cb_ptr_arr[msg.code])(NULL);
+				wifi_manager_publish(&msg, NULL);
 
 				break;
 
@@ -1242,23 +2918,48 @@ void wifi_manager( void * pvParameters ){
 					/* stop DNS */
 					dns_server_stop();
 
-					/* restart HTTP daemon */
-					http_app_stop();
-					http_app_start(false);
+					/* keep HTTP daemon running but stop purging sockets and redirecting clients */
+					http_app_set_lru_purge(false);
+					http_app_set_captive_portal(false);
 
 					/* callback */
-					if(cb_ptr_arr[msg.code]) (*cb_ptr_arr[msg.code])(NULL);
+					wifi_manager_publish(&msg, NULL);
 				}
 
 				break;
 
 			case WM_EVENT_STA_GOT_IP:
 				ESP_LOGI(TAG, "WM_EVENT_STA_GOT_IP");
-				ip_event_got_ip_t* ip_event_got_ip = (ip_event_got_ip_t*)msg.param; 
+				ip_event_got_ip_t* ip_event_got_ip = &msg.event.got_ip;
 				uxBits = xEventGroupGetBits(wifi_manager_event_group);
 
 				/* reset connection requests bits -- doesn't matter if it was set or not */
 				xEventGroupClearBits(wifi_manager_event_group, WIFI_MANAGER_REQUEST_STA_CONNECT_BIT);
+				wifi_manager_connect_end(WM_CONNECT_CONNECTED);
+
+				/* end of a handover: the access point stays pinned in the driver until the next connection order, but not in
+				 * the saved config. The signal of the new access point is averaged from scratch */
+				if(wifi_manager_roaming_state == WM_ROAMING_JOINING){
+					wifi_manager_roaming_state = WM_ROAMING_IDLE;
+					wifi_manager_get_wifi_sta_config()->sta.bssid_set = false;
+					wifi_manager_get_wifi_sta_config()->sta.channel = 0;
+				}
+				wifi_manager_roaming_rssi = 0;
+
+				/* remember the channel of the access point for a quick reconnection */
+				wifi_ap_record_t ap;
+				if(esp_wifi_sta_get_ap_info(&ap) == ESP_OK){
+					wifi_manager_sta_channel = ap.primary;
+
+					/* the access point has to share the channel of the STA: it is moved once rather than switching back and forth */
+					if(WIFI_MANAGER_AP_AUTO_CHANNEL && (uxBits & WIFI_MANAGER_AP_STARTED_BIT) && wifi_manager_set_ap_channel(&ap_config, ap.primary)){
+						diag_count(DIAG_COUNTER_AP_CHANNEL_MOVES);
+					}
+				}
+
+				if(wifi_manager_roaming_timer){
+					xTimerStart( wifi_manager_roaming_timer, (TickType_t)0 );
+				}
 
 				/* save IP as a string for the HTTP server host */
 				wifi_manager_safe_update_sta_ip_string(ip_event_got_ip->ip_info.ip.addr);
@@ -1285,26 +2986,100 @@ void wifi_manager( void * pvParameters ){
 				/* bring down DNS hijack */
 				dns_server_stop();
 
+				/* publish the device on the network. Started once, later IP changes are announced by the mdns component */
+				wifi_manager_initialise_mdns();
+
 				/* start the timer that will eventually shutdown the access point
 				 * We check first that it's actually running because in case of a boot and restore connection
-				 * the AP is not even started to begin with.
+				 * the AP is not even started to begin with. With sta_only cleared the AP is kept up (APSTA).
+				 * How long it stays up depends on the power profile.
 				 */
-				if(uxBits & WIFI_MANAGER_AP_STARTED_BIT){
-					TickType_t t = pdMS_TO_TICKS( WIFI_MANAGER_SHUTDOWN_AP_TIMER );
+				if((uxBits & WIFI_MANAGER_AP_STARTED_BIT) && wifi_settings.sta_only){
+					wifi_manager_schedule_ap_shutdown();
+				}
 
-					/* if for whatever reason user configured the shutdown timer to be less than 1 tick, the AP is stopped straight away */
-					if(t > 0){
-						xTimerStart( wifi_manager_shutdown_ap_timer, (TickType_t)0 );
-					}
-					else{
-						wifi_manager_send_message(WM_ORDER_STOP_AP, (void*)NULL);
-					}
+				/* callback */
+				wifi_manager_publish(&msg, ip_event_got_ip);
+				diag_dispatch_connection_sample();
+
+				break;
+
+			case WM_ORDER_START_HTTP_SERVER:
+				ESP_LOGI(TAG, "MESSAGE: ORDER_START_HTTP_SERVER");
+
+				/* sockets are only purged and clients redirected when the access point is up */
+				uxBits = xEventGroupGetBits(wifi_manager_event_group);
+				http_app_start( (uxBits & WIFI_MANAGER_AP_STARTED_BIT) != 0 );
+				http_app_set_captive_portal( (uxBits & WIFI_MANAGER_AP_STARTED_BIT) != 0 );
+
+				/* callback */
+				wifi_manager_publish(&msg, NULL);
+
+				break;
+
+			case WM_ORDER_STOP_HTTP_SERVER:
+				ESP_LOGI(TAG, "MESSAGE: ORDER_STOP_HTTP_SERVER");
+
+				http_app_stop();
+
+				/* callback */
+				wifi_manager_publish(&msg, NULL);
 
+				break;
+
+			case WM_ORDER_START_DNS_SERVICE:
+				ESP_LOGI(TAG, "MESSAGE: ORDER_START_DNS_SERVICE");
+
+				dns_server_start();
+
+				/* callback */
+				wifi_manager_publish(&msg, NULL);
+
+				break;
+
+			case WM_ORDER_STOP_DNS_SERVICE:
+				ESP_LOGI(TAG, "MESSAGE: ORDER_STOP_DNS_SERVICE");
+
+				dns_server_stop();
+
+				/* callback */
+				wifi_manager_publish(&msg, NULL);
+
+				break;
+
+			case WM_ORDER_SET_POWER_PROFILE:
+				ESP_LOGI(TAG, "MESSAGE: ORDER_SET_POWER_PROFILE");
+
+				if((BaseType_t)msg.param >= 0 && (BaseType_t)msg.param < WIFI_MANAGER_POWER_PROFILE_COUNT){
+					wifi_manager_apply_power_profile((wifi_manager_power_profile_t)msg.param);
+
+					/* the power save mode is what restores the profile at boot */
+					wifi_manager_save_sta_config();
 				}
 
-				/* callback and free memory allocated for the void* param */
-				if(cb_ptr_arr[msg.code]) (*cb_ptr_arr[msg.code])( msg.param );
-				free(ip_event_got_ip);
+				/* callback */
+				wifi_manager_publish(&msg, NULL);
+
+				break;
+
+			case WM_ORDER_ROAMING_CHECK:
+				ESP_LOGD(TAG, "MESSAGE: ORDER_ROAMING_CHECK");
+
+				wifi_manager_roaming_check();
+
+				/* callback */
+				wifi_manager_publish(&msg, NULL);
+
+				break;
+
+			case WM_ORDER_UPDATE_SETTINGS:
+				ESP_LOGI(TAG, "MESSAGE: ORDER_UPDATE_SETTINGS");
+
+				wifi_manager_apply_settings(&ap_config, &msg.event.settings);
+				memset(msg.event.settings.settings.ap_pwd, 0x00, sizeof(msg.event.settings.settings.ap_pwd));
+
+				/* callback */
+				wifi_manager_publish(&msg, NULL);
 
 				break;
 
@@ -1313,12 +3088,13 @@ void wifi_manager( void * pvParameters ){
 
 				/* precise this is coming from a user request */
 				xEventGroupSetBits(wifi_manager_event_group, WIFI_MANAGER_REQUEST_DISCONNECT_BIT);
+				wifi_manager_roaming_reset();
 
 				/* order wifi discconect */
 				ESP_ERROR_CHECK(esp_wifi_disconnect());
 
 				/* callback */
-				if(cb_ptr_arr[msg.code]) (*cb_ptr_arr[msg.code])(NULL);
+				wifi_manager_publish(&msg, NULL);
 
 				break;
 
@@ -33,6 +33,9 @@ Contains the freeRTOS task and all necessary support
 #define WIFI_MANAGER_H_INCLUDED
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "json.h"
 
 
 #ifdef __cplusplus
@@ -58,8 +61,9 @@ extern "C" {
  *
  * To save memory and avoid nasty out of memory errors,
  * we can limit the number of APs detected in a wifi scan.
+ * Only the scan records take memory: /ap.json is streamed from them in chunks of HTTP_APP_CHUNK_SIZE bytes.
  */
-#define MAX_AP_NUM 							15
+#define MAX_AP_NUM 							CONFIG_WIFI_MANAGER_MAX_AP_NUM
 
 
 /**
@@ -81,6 +85,57 @@ extern "C" {
  */
 #define WIFI_MANAGER_SHUTDOWN_AP_TIMER		CONFIG_WIFI_MANAGER_SHUTDOWN_AP_TIMER
 
+/**
+ * @brief Defines if the HTTP server is started lazily.
+ * When set, the HTTP server is not started at boot but only with the access point, or when a WM_ORDER_START_HTTP_SERVER
+ * message is sent. This shortens the time it takes to restore a saved connection.
+ */
+#ifdef CONFIG_WIFI_MANAGER_LAZY_START
+#define WIFI_MANAGER_LAZY_START				1
+#else
+#define WIFI_MANAGER_LAZY_START				0
+#endif
+
+
+/**
+ * @brief Defines if the STA roams to a stronger access point of the same SSID when its signal gets weak.
+ * The signal is checked every WIFI_MANAGER_ROAMING_CHECK_INTERVAL ms. Once its average is below WIFI_MANAGER_ROAMING_RSSI_THRESHOLD,
+ * the SSID is scanned, at most once every WIFI_MANAGER_ROAMING_SCAN_INTERVAL ms, and the STA hands over to an access point
+ * at least WIFI_MANAGER_ROAMING_HYSTERESIS dB stronger.
+ */
+#ifdef CONFIG_WIFI_MANAGER_ROAMING
+#define WIFI_MANAGER_ROAMING				1
+#define WIFI_MANAGER_ROAMING_RSSI_THRESHOLD	CONFIG_WIFI_MANAGER_ROAMING_RSSI_THRESHOLD
+#define WIFI_MANAGER_ROAMING_HYSTERESIS		CONFIG_WIFI_MANAGER_ROAMING_HYSTERESIS
+#define WIFI_MANAGER_ROAMING_SCAN_INTERVAL	CONFIG_WIFI_MANAGER_ROAMING_SCAN_INTERVAL
+#else
+#define WIFI_MANAGER_ROAMING				0
+#define WIFI_MANAGER_ROAMING_RSSI_THRESHOLD	-70
+#define WIFI_MANAGER_ROAMING_HYSTERESIS		8
+#define WIFI_MANAGER_ROAMING_SCAN_INTERVAL	60000
+#endif
+
+/** @brief Defines the time (in ms) between two checks of the signal of the access point when roaming is enabled. */
+#define WIFI_MANAGER_ROAMING_CHECK_INTERVAL	5000
+
+/** @brief Defines the maximum number of access points of the current SSID considered after a roaming scan. */
+#define WIFI_MANAGER_ROAMING_MAX_CANDIDATES	6
+
+/**
+ * @brief Defines the channels scanned, besides the one in use, to find another access point when roaming.
+ * Multi access point networks are usually laid out on channels 1, 6 and 11.
+ */
+#define WIFI_MANAGER_ROAMING_SCAN_CHANNELS	(WIFI_MANAGER_SCAN_CHANNEL(1) | WIFI_MANAGER_SCAN_CHANNEL(6) | WIFI_MANAGER_SCAN_CHANNEL(11))
+
+/** @brief Defines the time (in ms) spent on each channel by a roaming scan. */
+#define WIFI_MANAGER_ROAMING_SCAN_DWELL		40
+
+/** @brief Bit of a scan channel mask. */
+#define WIFI_MANAGER_SCAN_CHANNEL(channel)	((uint16_t)(1 << (channel)))
+
+/** @brief Channels that can be part of a scan channel mask: 1 to 14. */
+#define WIFI_MANAGER_SCAN_CHANNELS_VALID	((uint16_t)0x7ffe)
+
 
 /** @brief Defines the task priority of the wifi_manager.
  *
@@ -91,6 +146,21 @@ extern "C" {
  */
 #define WIFI_MANAGER_TASK_PRIORITY			CONFIG_WIFI_MANAGER_TASK_PRIORITY
 
+/** @brief Defines the stack size in bytes of the wifi_manager task. */
+#define WIFI_MANAGER_TASK_STACK_SIZE		4096
+
+/** @brief Defines the maximum number of event subscriptions, all message codes together. */
+#define WIFI_MANAGER_MAX_SUBSCRIBERS		16
+
+/** @brief Defines how many events can wait for deferred subscribers. Events that do not fit are dropped for the subscriber. */
+#define WIFI_MANAGER_EVENT_QUEUE_SIZE		8
+
+/** @brief Defines the stack size in bytes of the task running the deferred subscribers. It is only started if there is one. */
+#define WIFI_MANAGER_EVENT_TASK_STACK_SIZE	3072
+
+/** @brief A synchronous subscriber holding the wifi_manager task longer than this, in ms, is reported in the log. */
+#define WIFI_MANAGER_SLOW_SUBSCRIBER_MS		20
+
 /** @brief Defines the auth mode as an access point
  *  Value must be of type wifi_auth_mode_t
  *  @see esp_wifi_types.h
@@ -110,7 +180,7 @@ extern "C" {
  */
 #define DEFAULT_AP_PASSWORD 				CONFIG_DEFAULT_AP_PASSWORD
 
-/** @brief Defines the hostname broadcasted by mDNS */
+/** @brief Defines the hostname broadcasted by mDNS. The last 3 bytes of the MAC address are appended to it, eg esp32-a1b2c3 */
 #define DEFAULT_HOSTNAME					"esp32"
 
 /** @brief Defines access point's bandwidth.
@@ -128,6 +198,15 @@ extern "C" {
  */
 #define DEFAULT_AP_CHANNEL 					CONFIG_DEFAULT_AP_CHANNEL
 
+/** @brief Defines if the access point channel is picked from the last scan, DEFAULT_AP_CHANNEL being only used when nothing better is known.
+ *  @see Kconfig WIFI_MANAGER_AP_AUTO_CHANNEL
+ */
+#ifdef CONFIG_WIFI_MANAGER_AP_AUTO_CHANNEL
+#define WIFI_MANAGER_AP_AUTO_CHANNEL		1
+#else
+#define WIFI_MANAGER_AP_AUTO_CHANNEL		0
+#endif
+
 
 
 /** @brief Defines the access point's default IP address. Default: "10.10.0.1 */
@@ -160,30 +239,38 @@ extern "C" {
 #define DEFAULT_STA_POWER_SAVE 				WIFI_PS_NONE
 
 /**
- * @brief Defines the maximum length in bytes of a JSON representation of an access point.
+ * @brief Defines the change of rssi in dBm below which an access point is not reported as updated in /ap.json deltas.
+ */
+#define WIFI_MANAGER_AP_RSSI_HYSTERESIS		5
+
+/**
+ * @brief Defines how many access points that disappeared are remembered for /ap.json deltas.
+ * A client that missed more removals than this gets the full list.
+ */
+#define WIFI_MANAGER_AP_TOMBSTONE_NUM		8
+
+/**
+ * @brief Version of the binary access point list served at /ap.bin. It changes with any change of the layout.
  *
- *  maximum ap string length with full 32 char ssid: 75 + \\n + \0 = 77\n
- *  example: {"ssid":"abcdefghijklmnopqrstuvwxyz012345","chan":12,"rssi":-100,"auth":4},\n
- *  BUT: we need to escape JSON. Imagine a ssid full of \" ? so it's 32 more bytes hence 77 + 32 = 99.\n
- *  this is an edge case but I don't think we should crash in a catastrophic manner just because
- *  someone decided to have a funny wifi name.
+ * All fields are single bytes, there is no endianness to deal with. The header is:
+ * 'W', 'M', version, number of access points\n
+ * followed by each access point:
+ * ssid length, ssid (not null terminated), bssid (6 bytes), channel, rssi (signed), auth mode
  */
-#define JSON_ONE_APP_SIZE					99
+#define AP_LIST_BIN_VERSION					1
+
+/** @brief Size in bytes of the header of the binary access point list. */
+#define AP_LIST_BIN_HEADER_SIZE				4
+
+/** @brief Maximum size in bytes of one access point in the binary access point list. */
+#define AP_LIST_BIN_RECORD_MAX_SIZE			(1 + MAX_SSID_SIZE + 6 + 3)
 
 /**
- * @brief Defines the maximum length in bytes of a JSON representation of the IP information
- * assuming all ips are 4*3 digits, and all characters in the ssid require to be escaped.
- * example: {"ssid":"abcdefghijklmnopqrstuvwxyz012345","ip":"192.168.1.119","netmask":"255.255.255.0","gw":"192.168.1.1","urc":99}
- * Run this JS (browser console is easiest) to come to the conclusion that 159 is the worst case.
- * ```
- * var a = {"ssid":"abcdefghijklmnopqrstuvwxyz012345","ip":"255.255.255.255","netmask":"255.255.255.255","gw":"255.255.255.255","urc":99};
- * // Replace all ssid characters with a double quote which will have to be escaped
- * a.ssid = a.ssid.split('').map(() => '"').join('');
- * console.log(JSON.stringify(a).length); // => 158 +1 for null
- * console.log(JSON.stringify(a)); // print it
- * ```
+ * @brief Defines the maximum length in bytes of a JSON representation of the IP information, null terminator included.
+ * Worst case is all ips with 4*3 digits and a 32 characters ssid where every character has to be printed as \u00XX.
+ * example: {"ver":12,"ssid":"abcdefghijklmnopqrstuvwxyz012345","ip":"192.168.1.119","netmask":"255.255.255.0","gw":"192.168.1.1","urc":99}
  */
-#define JSON_IP_INFO_SIZE 					159
+#define JSON_IP_INFO_SIZE 					(sizeof("{\"ver\":2147483647,\"ssid\":,\"ip\":\"255.255.255.255\",\"netmask\":\"255.255.255.255\",\"gw\":\"255.255.255.255\",\"urc\":99}") + JSON_ESCAPED_STRING_MAX_SIZE(MAX_SSID_SIZE))
 
 
 /**
@@ -217,10 +304,39 @@ typedef enum message_code_t {
 	WM_EVENT_SCAN_DONE = 11,
 	WM_EVENT_STA_GOT_IP = 12,
 	WM_ORDER_STOP_AP = 13,
-	WM_MESSAGE_CODE_COUNT = 14 /* important for the callback array */
+	WM_ORDER_SET_POWER_PROFILE = 14,
+	WM_ORDER_ROAMING_CHECK = 15,
+	WM_ORDER_UPDATE_SETTINGS = 16,
+	WM_MESSAGE_CODE_COUNT = 17 /* important for the callback array */
 
 }message_code_t;
 
+/**
+ * @brief How a subscriber gets the messages it subscribed to.
+ */
+typedef enum wifi_manager_delivery_t{
+	WM_DELIVERY_SYNC = 0,		/* called by the wifi_manager task before it moves on to the next message */
+	WM_DELIVERY_DEFERRED = 1	/* called by a separate task with a copy of the event data: it cannot delay the wifi manager */
+}wifi_manager_delivery_t;
+
+/**
+ * @brief Time spent by a subscriber handling its messages, in us.
+ * wait is the time between a message and the call of a deferred subscriber. dropped counts the messages a deferred subscriber
+ * missed because too many were waiting.
+ */
+typedef struct{
+	uint32_t id;
+	message_code_t code;
+	void (*func_ptr)(void*);
+	wifi_manager_delivery_t delivery;
+	uint32_t calls;
+	uint32_t dropped;
+	uint32_t last_us;
+	uint32_t max_us;
+	uint32_t avg_us;
+	uint32_t max_wait_us;
+}wifi_manager_subscriber_report_t;
+
 /**
  * @brief simplified reason codes for a lost connection.
  *
@@ -233,6 +349,33 @@ typedef enum update_reason_code_t {
 	UPDATE_LOST_CONNECTION = 3
 }update_reason_code_t;
 
+/**
+ * @brief Power profiles of the wifi manager.
+ *
+ * A profile sets together the power save mode and listen interval of the STA, the minimum time between two wifi scans
+ * and how long the access point is kept alive once a connection is made.
+ * - performance: no power save, scans on every request, the access point stays up WIFI_MANAGER_SHUTDOWN_AP_TIMER ms.
+ * - balanced: WIFI_PS_MIN_MODEM, at most one scan every 5 s, same access point timer.
+ * - low power: WIFI_PS_MAX_MODEM with a listen interval of 10 beacons, at most one scan every 30 s, the access point is
+ *   shut down as soon as the STA gets an IP.
+ * @note power save is only effective in STA mode, and the listen interval is applied at the next connection.
+ */
+typedef enum wifi_manager_power_profile_t{
+	WIFI_MANAGER_POWER_PERFORMANCE = 0,
+	WIFI_MANAGER_POWER_BALANCED = 1,
+	WIFI_MANAGER_POWER_LOW = 2,
+	WIFI_MANAGER_POWER_PROFILE_COUNT = 3
+}wifi_manager_power_profile_t;
+
+/**
+ * @brief Time spent in each power profile since boot, in ms, and number of profile changes.
+ */
+typedef struct{
+	wifi_manager_power_profile_t profile;
+	uint32_t switches;
+	uint64_t time_ms[WIFI_MANAGER_POWER_PROFILE_COUNT];
+}wifi_manager_power_report_t;
+
 typedef enum connection_request_made_by_code_t{
 	CONNECTION_REQUEST_NONE = 0,
 	CONNECTION_REQUEST_USER = 1,
@@ -257,13 +400,95 @@ struct wifi_settings_t{
 };
 extern struct wifi_settings_t wifi_settings;
 
+/**
+ * @brief Fields of wifi_settings, as flags of a change set.
+ */
+typedef enum wifi_manager_setting_t{
+	WM_SETTING_AP_SSID = 1 << 0,
+	WM_SETTING_AP_PWD = 1 << 1,
+	WM_SETTING_AP_CHANNEL = 1 << 2,
+	WM_SETTING_AP_SSID_HIDDEN = 1 << 3,
+	WM_SETTING_AP_BANDWIDTH = 1 << 4,
+	WM_SETTING_STA_ONLY = 1 << 5,
+	WM_SETTING_STA_POWER_SAVE = 1 << 6,
+	WM_SETTING_STA_STATIC_IP = 1 << 7,
+	WM_SETTING_STA_IP = 1 << 8,
+	WM_SETTING_STA_NETMASK = 1 << 9,
+	WM_SETTING_STA_GW = 1 << 10
+}wifi_manager_setting_t;
+
+/**
+ * @brief A change set of wifi_settings: only the fields flagged in fields are read from settings, validated and applied.
+ */
+typedef struct{
+	uint16_t fields;					/* wifi_manager_setting_t flags */
+	struct wifi_settings_t settings;
+}wifi_manager_settings_change_t;
+
+
+/**
+ * @brief Parameters of a wifi scan.
+ * A channel mask scans each channel in turn, going back to the channel of the access point in between when the STA is connected.
+ */
+typedef struct{
+	uint16_t channel_mask;			/* WIFI_MANAGER_SCAN_CHANNEL(n) for each channel to scan, 0 for all channels in one pass */
+	bool passive;					/* listen for beacons instead of sending probe requests */
+	bool show_hidden;				/* also list access points that do not broadcast their SSID */
+	uint16_t dwell_ms;				/* time spent on each channel, 0 for the driver default */
+	char ssid[MAX_SSID_SIZE+1];		/* only list this SSID, all SSIDs if empty */
+}wifi_manager_scan_params_t;
+
+/**
+ * @brief A request to connect to an access point. It is copied into the queue message: the wifi_manager task is the only one
+ * to apply it to the STA config.
+ */
+typedef struct{
+	uint32_t id;							/* assigned when the request is submitted */
+	uint8_t ssid[MAX_SSID_SIZE+1];
+	uint8_t password[MAX_PASSWORD_SIZE+1];
+	bool bssid_set;							/* only connect to the access point with this bssid */
+	uint8_t bssid[6];
+	bool ip_set;							/* the request sets the IP config. Otherwise the one in wifi_settings is kept */
+	bool static_ip;							/* with ip_set: static IP from ip_info, DHCP otherwise */
+	esp_netif_ip_info_t ip_info;
+}wifi_manager_connect_request_t;
+
+/**
+ * @brief Outcome of a connection request.
+ */
+typedef enum wifi_manager_connect_status_t{
+	WM_CONNECT_UNKNOWN = 0,		/* no such request, or too old to be remembered */
+	WM_CONNECT_PENDING = 1,		/* waiting in the queue of the wifi_manager */
+	WM_CONNECT_CONNECTING = 2,
+	WM_CONNECT_CONNECTED = 3,
+	WM_CONNECT_FAILED = 4,
+	WM_CONNECT_SUPERSEDED = 5	/* another request was processed before this one completed */
+}wifi_manager_connect_status_t;
+
+/** @brief Defines how many processed connection requests are remembered for wifi_manager_get_connect_status. */
+#define WIFI_MANAGER_CONNECT_HISTORY_NUM	8
+
+/**
+ * @brief Data of the esp-idf events forwarded to the wifi_manager task, and of the orders that need more than a pointer,
+ * carried inside the queue message.
+ */
+typedef union{
+	wifi_event_sta_scan_done_t scan_done;
+	wifi_event_sta_disconnected_t sta_disconnected;
+	ip_event_got_ip_t got_ip;
+	wifi_manager_scan_params_t scan;
+	wifi_manager_connect_request_t connect;
+	wifi_manager_settings_change_t settings;
+} queue_message_event_t;
 
 /**
  * @brief Structure used to store one message in the queue.
+ * Events keep their data in event, orders use param: nothing is allocated to post a message.
  */
 typedef struct{
 	message_code_t code;
 	void *param;
+	queue_message_event_t event;
 } queue_message;
 
 
@@ -299,12 +524,58 @@ void filter_unique( wifi_ap_record_t * aplist, uint16_t * ap_num);
 void wifi_manager( void * pvParameters );
 
 
-char* wifi_manager_get_ap_list_json();
+/**
+ * @brief Prints the list of access points found by the last scan.
+ * @note This is not thread-safe and should be called only if wifi_manager_lock_json_buffer call is successful.
+ * @return false if the writer failed.
+ */
+bool wifi_manager_get_ap_list_json(json_writer_t *writer);
+
+/**
+ * @brief Returns the generation of the access point list. It increases every time a scan changes the list.
+ * @note This is not thread-safe and should be called only if wifi_manager_lock_json_buffer call is successful.
+ */
+uint32_t wifi_manager_get_ap_list_generation();
+
+/**
+ * @brief Prints what changed in the access point list since a generation, as
+ * {"gen":N,"full":false,"removed":[{"ssid":...,"auth":...}],"added":[...],"updated":[...]}\n
+ * Removals must be applied before additions: an access point can be both removed and added back.
+ * If the changes cannot be computed from this generation, the whole list is printed as {"gen":N,"full":true,"aps":[...]}
+ * @note This is not thread-safe and should be called only if wifi_manager_lock_json_buffer call is successful.
+ * @return false if the writer failed.
+ */
+bool wifi_manager_get_ap_list_delta_json(json_writer_t *writer, uint32_t since);
+
+/**
+ * @brief Prints the header of the binary access point list served at /ap.bin.
+ * @param buf output buffer of at least AP_LIST_BIN_HEADER_SIZE bytes.
+ * @note This is not thread-safe and should be called only if wifi_manager_lock_json_buffer call is successful.
+ * @return the number of bytes written.
+ */
+size_t wifi_manager_get_ap_list_bin_header(uint8_t *buf);
+
+/**
+ * @brief Prints one access point of the binary access point list served at /ap.bin.
+ * @param buf output buffer of at least AP_LIST_BIN_RECORD_MAX_SIZE bytes.
+ * @note This is not thread-safe and should be called only if wifi_manager_lock_json_buffer call is successful.
+ * @return the number of bytes written, 0 if there is no access point at this index.
+ */
+size_t wifi_manager_get_ap_list_bin_record(uint16_t index, uint8_t *buf);
 char* wifi_manager_get_ip_info_json();
 
 
+/**
+ * @brief Requests a scan of all channels, listing hidden access points too, to refresh the access point list of the web app.
+ */
 void wifi_manager_scan_async();
 
+/**
+ * @brief Requests a scan limited by the given parameters. The access point list is refreshed with its results.
+ * The parameters are copied: they do not need to outlive the call.
+ */
+void wifi_manager_scan_with_params_async(const wifi_manager_scan_params_t *params);
+
 
 /**
  * @brief saves the current STA wifi config to flash ram storage.
@@ -322,9 +593,36 @@ wifi_config_t* wifi_manager_get_wifi_sta_config();
 
 /**
  * @brief requests a connection to an access point that will be process in the main task thread.
+ * The access point is the one set in the config returned by wifi_manager_get_wifi_sta_config.
+ * @see wifi_manager_request_connect to connect from another task than the wifi_manager one.
  */
 void wifi_manager_connect_async();
 
+/**
+ * @brief requests a connection to the access point of a request. Safe to call from any task: the request is copied
+ * and the STA config is only updated by the wifi_manager task. Does not block.
+ * @param ssid_len length of ssid, at most MAX_SSID_SIZE.
+ * @param password_len length of password, at most MAX_PASSWORD_SIZE.
+ * @return the id of the request, to be given to wifi_manager_get_connect_status. 0 if the queue of the wifi_manager is full.
+ */
+uint32_t wifi_manager_request_connect(const char *ssid, size_t ssid_len, const char *password, size_t password_len);
+
+/**
+ * @brief same as wifi_manager_request_connect with all the options of a connection request. The id of the request is ignored.
+ * @return the id of the request, 0 if the queue of the wifi_manager is full.
+ */
+uint32_t wifi_manager_submit_connect_request(const wifi_manager_connect_request_t *request);
+
+/**
+ * @brief returns the outcome of a connection request. Safe to call from any task.
+ */
+wifi_manager_connect_status_t wifi_manager_get_connect_status(uint32_t id);
+
+/**
+ * @brief returns the name of a connection request status as used in /connect.json.
+ */
+const char* wifi_manager_get_connect_status_name(wifi_manager_connect_status_t status);
+
 /**
  * @brief requests a wifi scan
  */
@@ -363,16 +661,16 @@ void wifi_manager_unlock_json_buffer();
  */
 void wifi_manager_generate_ip_info_json(update_reason_code_t update_reason_code);
 /**
- * @brief Clears the connection status json.
+ * @brief Returns the version of the connection status json, printed in it as "ver". It increases every time the json is regenerated.
  * @note This is not thread-safe and should be called only if wifi_manager_lock_json_buffer call is successful.
  */
-void wifi_manager_clear_ip_info_json();
+uint32_t wifi_manager_get_ip_info_json_version();
 
 /**
- * @brief Generates the list of access points after a wifi scan.
+ * @brief Clears the connection status json.
  * @note This is not thread-safe and should be called only if wifi_manager_lock_json_buffer call is successful.
  */
-void wifi_manager_generate_acess_points_json();
+void wifi_manager_clear_ip_info_json();
 
 /**
  * @brief Clear the list of access points.
@@ -382,10 +680,74 @@ void wifi_manager_clear_access_points_json();
 
 
 /**
- * @brief Start the mDNS service
+ * @brief Start the mDNS service and register the _http._tcp service of the web app.
+ * Called by the wifi manager when the access point starts or when the STA gets an IP. Calling it again has no effect.
  */
 void wifi_manager_initialise_mdns();
 
+/**
+ * @brief returns the mDNS hostname of the device, without the .local suffix.
+ */
+const char* wifi_manager_get_hostname();
+
+/**
+ * @brief Requests a change of power profile. The profile is applied by the wifi_manager task.
+ * The power save mode of the profile is saved with the wifi settings.
+ * @return ESP_ERR_TIMEOUT if the queue of the wifi_manager is full, ESP_OK otherwise.
+ * @note it never blocks: it can be called from the http server.
+ */
+esp_err_t wifi_manager_set_power_profile_async(wifi_manager_power_profile_t profile);
+
+/**
+ * @brief returns the power profile in use.
+ */
+wifi_manager_power_profile_t wifi_manager_get_power_profile();
+
+/**
+ * @brief returns the name of a power profile: "performance", "balanced" or "low-power".
+ */
+const char* wifi_manager_get_power_profile_name(wifi_manager_power_profile_t profile);
+
+/**
+ * @brief Finds a power profile by its name.
+ * @return false if there is no profile with this name.
+ */
+bool wifi_manager_get_power_profile_by_name(const char *name, wifi_manager_power_profile_t *profile);
+
+/**
+ * @brief Fills a report of the time spent in each power profile.
+ */
+void wifi_manager_get_power_report(wifi_manager_power_report_t *report);
+
+/**
+ * @brief Prints the power report as a JSON object. Times are in seconds.
+ * @return false if the writer failed.
+ */
+bool wifi_manager_get_power_json(json_writer_t *writer);
+
+/**
+ * @brief Finds a power save mode by its name: "none", "min_modem" or "max_modem".
+ * @return false if there is no power save mode with this name.
+ */
+bool wifi_manager_get_power_save_by_name(const char *name, wifi_ps_type_t *power_save);
+
+/**
+ * @brief Requests a change of some of the wifi settings. The fields of the change set are validated right away, then
+ * applied by the wifi_manager task and saved with a single write to flash.
+ * - the access point is reconfigured in place if it is running, and when it starts otherwise. Its channel follows the STA while connected.
+ * - sta_only and the power save mode take effect immediately. The power save mode switches to the power profile that uses it.
+ * - the static IP config is used from the next connection.
+ * @return ESP_ERR_INVALID_ARG if a field is out of range, ESP_ERR_TIMEOUT if the queue of the wifi_manager is full, ESP_OK otherwise.
+ * @note it never blocks: it can be called from the http server.
+ */
+esp_err_t wifi_manager_update_settings_async(const wifi_manager_settings_change_t *change);
+
+/**
+ * @brief Prints the wifi settings as a JSON object. The password of the access point is never printed.
+ * @return false if the writer failed.
+ */
+bool wifi_manager_get_settings_json(json_writer_t *writer);
+
 
 bool wifi_manager_lock_sta_ip_string(TickType_t xTicksToWait);
 void wifi_manager_unlock_sta_ip_string();
@@ -395,6 +757,12 @@ void wifi_manager_unlock_sta_ip_string();
  */
 char* wifi_manager_get_sta_ip_string();
 
+/**
+ * @brief gets the STA IP address as a number in network byte order, 0 when not connected.
+ * It does not need wifi_manager_lock_sta_ip_string and can be called from any task.
+ */
+uint32_t wifi_manager_get_sta_ip();
+
 /**
  * @brief thread safe char representation of the STA IP update
  */
@@ -403,13 +771,47 @@ void wifi_manager_safe_update_sta_ip_string(uint32_t ip);
 
 /**
  * @brief Register a callback to a custom function when specific event message_code happens.
+ * There is one such callback per message code, called synchronously: registering another one replaces it, NULL removes it.
+ * @see wifi_manager_subscribe to add more than one function to a message code.
  */
 void wifi_manager_set_callback(message_code_t message_code, void (*func_ptr)(void*) );
 
+/**
+ * @brief Adds a function to the subscribers of a message code. A message code can have any number of subscribers, up to
+ * WIFI_MANAGER_MAX_SUBSCRIBERS for all message codes together.
+ * A synchronous subscriber gets the same parameter as a callback, only valid for the duration of the call. A deferred one
+ * gets its own copy of the event data, valid for the duration of the call as well.
+ * @return the id of the subscription, 0 if there is no room left.
+ */
+uint32_t wifi_manager_subscribe(message_code_t message_code, void (*func_ptr)(void*), wifi_manager_delivery_t delivery);
+
+/**
+ * @brief Removes a subscription. Deferred messages still waiting for it are not delivered.
+ */
+void wifi_manager_unsubscribe(uint32_t id);
+
+/**
+ * @brief Fills a report of the time spent by each subscriber, callbacks included.
+ * @return the number of subscribers, at most size.
+ */
+uint8_t wifi_manager_get_subscriber_report(wifi_manager_subscriber_report_t *report, uint8_t size);
+
+/**
+ * @brief Prints the subscriber report as a JSON object.
+ * @return false if the writer failed.
+ */
+bool wifi_manager_get_subscribers_json(json_writer_t *writer);
+
 
 BaseType_t wifi_manager_send_message(message_code_t code, void *param);
 BaseType_t wifi_manager_send_message_to_front(message_code_t code, void *param);
 
+/**
+ * @brief Posts an event with a copy of its data inside the message itself.
+ * @param size size of event_data, at most sizeof(queue_message_event_t).
+ */
+BaseType_t wifi_manager_send_event(message_code_t code, const void *event_data, size_t size);
+
 #ifdef __cplusplus
 }
 #endif